@@ -0,0 +1,352 @@
+#include "cpu_scan.h"
+
+#include <atomic>
+#include <stdexcept>
+
+// The SIMD paths are compiled for their instruction set function by function
+// and picked at run time, so they need no -msse2/-mavx2 for the whole build.
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define CPU_SCAN_X86
+#include <immintrin.h>
+#define SIMD_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+ThreadPool::ThreadPool(size_t threads)
+{
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    for (size_t i = 1; i < threads; i++) {
+        workers_.emplace_back(&ThreadPool::work, this);
+    }
+}
+
+ThreadPool::~ThreadPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stop_ = true;
+    }
+    wake_.notify_all();
+    for (std::thread& worker: workers_) {
+        worker.join();
+    }
+}
+
+void ThreadPool::run(size_t tasks, std::function<void(size_t)> const& task)
+{
+    if (tasks == 0) {
+        return;
+    }
+    std::lock_guard<std::mutex> run_lock(run_mutex_);
+    std::unique_lock<std::mutex> lock(mutex_);
+    task_ = &task;
+    tasks_ = tasks;
+    next_ = 0;
+    pending_ = tasks;
+    ++generation_;
+    if (tasks > 1) {
+        wake_.notify_all();
+    }
+    drain(lock);
+    done_.wait(lock, [this]{ return pending_ == 0; });
+    task_ = nullptr;
+}
+
+void ThreadPool::work()
+{
+    std::unique_lock<std::mutex> lock(mutex_);
+    unsigned seen = generation_;
+    for (;;) {
+        wake_.wait(lock, [&]{ return stop_ || generation_ != seen; });
+        if (stop_) {
+            return;
+        }
+        seen = generation_;
+        drain(lock);
+    }
+}
+
+void ThreadPool::drain(std::unique_lock<std::mutex>& lock)
+{
+    while (next_ < tasks_) {
+        size_t const index = next_++;
+        std::function<void(size_t)> const& task = *task_;
+        lock.unlock();
+        task(index);
+        lock.lock();
+        if (--pending_ == 0) {
+            done_.notify_all();
+        }
+    }
+}
+
+ThreadPool& cpu_scan_pool()
+{
+    static ThreadPool pool;
+    return pool;
+}
+
+simd_isa cpu_simd_isa()
+{
+#if defined(CPU_SCAN_X86)
+    static simd_isa const isa = __builtin_cpu_supports("avx2") ? simd_isa::avx2
+                              : __builtin_cpu_supports("sse2") ? simd_isa::sse2
+                              : simd_isa::scalar;
+    return isa;
+#else
+    return simd_isa::scalar;
+#endif
+}
+
+static std::atomic<simd_isa>& selected_isa()
+{
+    static std::atomic<simd_isa> isa(cpu_simd_isa());
+    return isa;
+}
+
+simd_isa cpu_scan_isa()
+{
+    return selected_isa().load();
+}
+
+void set_cpu_scan_isa(simd_isa isa)
+{
+    if (isa > cpu_simd_isa()) throw std::invalid_argument("instruction set not supported by this CPU");
+    selected_isa().store(isa);
+}
+
+char const* simd_isa_name(simd_isa isa)
+{
+    switch (isa) {
+    case simd_isa::avx2: return "avx2";
+    case simd_isa::sse2: return "sse2";
+    default: return "scalar";
+    }
+}
+
+template<typename T>
+static T scalar_scan(T const* input, T* output, size_t n)
+{
+    T running = output[0] = input[0];
+    for (size_t i = 1; i < n; i++) {
+        output[i] = running += input[i];
+    }
+    return running;
+}
+
+template<typename T>
+static void scalar_offset(T* output, size_t n, T carry)
+{
+    for (size_t i = 0; i < n; i++) {
+        output[i] = carry + output[i];
+    }
+}
+
+#if defined(CPU_SCAN_X86)
+
+// In-register inclusive prefix sums: log2(lanes) shift-and-add steps inside
+// each 128-bit lane, then the low lane's total is added to the high lane.
+// Each vector is offset by the broadcast last element of the one before.
+
+SIMD_TARGET("avx2") static inline __m256 prefix_sum(__m256 x)
+{
+    x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 4)));
+    x = _mm256_add_ps(x, _mm256_castsi256_ps(_mm256_slli_si256(_mm256_castps_si256(x), 8)));
+    __m256 low = _mm256_permute2f128_ps(x, x, 0x08);
+    return _mm256_add_ps(x, _mm256_permute_ps(low, 0xff));
+}
+
+SIMD_TARGET("avx2") static inline __m256i prefix_sum(__m256i x)
+{
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 4));
+    x = _mm256_add_epi32(x, _mm256_slli_si256(x, 8));
+    __m256i low = _mm256_permute2x128_si256(x, x, 0x08);
+    return _mm256_add_epi32(x, _mm256_shuffle_epi32(low, 0xff));
+}
+
+SIMD_TARGET("avx2") static cl_float scan_avx2(cl_float const* input, cl_float* output, size_t n)
+{
+    size_t const lanes = 8;
+    __m256 carry = _mm256_setzero_ps();
+    __m256i const last = _mm256_set1_epi32(lanes - 1);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        __m256 x = _mm256_add_ps(prefix_sum(_mm256_loadu_ps(input + i)), carry);
+        _mm256_storeu_ps(output + i, x);
+        carry = _mm256_permutevar8x32_ps(x, last);
+    }
+    cl_float running = _mm256_cvtss_f32(carry);
+    for (; i < n; i++) {
+        output[i] = running += input[i];
+    }
+    return running;
+}
+
+SIMD_TARGET("avx2") static void offset_avx2(cl_float* output, size_t n, cl_float carry)
+{
+    size_t const lanes = 8;
+    __m256 const c = _mm256_set1_ps(carry);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        _mm256_storeu_ps(output + i, _mm256_add_ps(c, _mm256_loadu_ps(output + i)));
+    }
+    for (; i < n; i++) {
+        output[i] = carry + output[i];
+    }
+}
+
+SIMD_TARGET("avx2") static cl_int scan_avx2(cl_int const* input, cl_int* output, size_t n)
+{
+    size_t const lanes = 8;
+    __m256i carry = _mm256_setzero_si256();
+    __m256i const last = _mm256_set1_epi32(lanes - 1);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        __m256i x = _mm256_loadu_si256(reinterpret_cast<__m256i const*>(input + i));
+        x = _mm256_add_epi32(prefix_sum(x), carry);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(output + i), x);
+        carry = _mm256_permutevar8x32_epi32(x, last);
+    }
+    cl_int running = _mm256_cvtsi256_si32(carry);
+    for (; i < n; i++) {
+        output[i] = running += input[i];
+    }
+    return running;
+}
+
+SIMD_TARGET("avx2") static void offset_avx2(cl_int* output, size_t n, cl_int carry)
+{
+    size_t const lanes = 8;
+    __m256i const c = _mm256_set1_epi32(carry);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        __m256i* out = reinterpret_cast<__m256i*>(output + i);
+        _mm256_storeu_si256(out, _mm256_add_epi32(c, _mm256_loadu_si256(out)));
+    }
+    for (; i < n; i++) {
+        output[i] = carry + output[i];
+    }
+}
+
+SIMD_TARGET("sse2") static inline __m128 prefix_sum(__m128 x)
+{
+    x = _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 4)));
+    return _mm_add_ps(x, _mm_castsi128_ps(_mm_slli_si128(_mm_castps_si128(x), 8)));
+}
+
+SIMD_TARGET("sse2") static inline __m128i prefix_sum(__m128i x)
+{
+    x = _mm_add_epi32(x, _mm_slli_si128(x, 4));
+    return _mm_add_epi32(x, _mm_slli_si128(x, 8));
+}
+
+SIMD_TARGET("sse2") static cl_float scan_sse2(cl_float const* input, cl_float* output, size_t n)
+{
+    size_t const lanes = 4;
+    __m128 carry = _mm_setzero_ps();
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        __m128 x = _mm_add_ps(prefix_sum(_mm_loadu_ps(input + i)), carry);
+        _mm_storeu_ps(output + i, x);
+        carry = _mm_shuffle_ps(x, x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    cl_float running = _mm_cvtss_f32(carry);
+    for (; i < n; i++) {
+        output[i] = running += input[i];
+    }
+    return running;
+}
+
+SIMD_TARGET("sse2") static void offset_sse2(cl_float* output, size_t n, cl_float carry)
+{
+    size_t const lanes = 4;
+    __m128 const c = _mm_set1_ps(carry);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        _mm_storeu_ps(output + i, _mm_add_ps(c, _mm_loadu_ps(output + i)));
+    }
+    for (; i < n; i++) {
+        output[i] = carry + output[i];
+    }
+}
+
+SIMD_TARGET("sse2") static cl_int scan_sse2(cl_int const* input, cl_int* output, size_t n)
+{
+    size_t const lanes = 4;
+    __m128i carry = _mm_setzero_si128();
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<__m128i const*>(input + i));
+        x = _mm_add_epi32(prefix_sum(x), carry);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(output + i), x);
+        carry = _mm_shuffle_epi32(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    cl_int running = _mm_cvtsi128_si32(carry);
+    for (; i < n; i++) {
+        output[i] = running += input[i];
+    }
+    return running;
+}
+
+SIMD_TARGET("sse2") static void offset_sse2(cl_int* output, size_t n, cl_int carry)
+{
+    size_t const lanes = 4;
+    __m128i const c = _mm_set1_epi32(carry);
+    size_t i = 0;
+    for (; i + lanes <= n; i += lanes) {
+        __m128i* out = reinterpret_cast<__m128i*>(output + i);
+        _mm_storeu_si128(out, _mm_add_epi32(c, _mm_loadu_si128(out)));
+    }
+    for (; i < n; i++) {
+        output[i] = carry + output[i];
+    }
+}
+
+#endif
+
+template<typename T>
+static T dispatch_scan(T const* input, T* output, size_t n)
+{
+#if defined(CPU_SCAN_X86)
+    switch (cpu_scan_isa()) {
+    case simd_isa::avx2: return scan_avx2(input, output, n);
+    case simd_isa::sse2: return scan_sse2(input, output, n);
+    default: break;
+    }
+#endif
+    return scalar_scan(input, output, n);
+}
+
+template<typename T>
+static void dispatch_offset(T* output, size_t n, T carry)
+{
+#if defined(CPU_SCAN_X86)
+    switch (cpu_scan_isa()) {
+    case simd_isa::avx2: return offset_avx2(output, n, carry);
+    case simd_isa::sse2: return offset_sse2(output, n, carry);
+    default: break;
+    }
+#endif
+    scalar_offset(output, n, carry);
+}
+
+cl_float chunk_scan<cl_float, scan_add>::scan(cl_float const* input, cl_float* output, size_t n)
+{
+    return dispatch_scan(input, output, n);
+}
+
+void chunk_scan<cl_float, scan_add>::offset(cl_float* output, size_t n, cl_float carry)
+{
+    dispatch_offset(output, n, carry);
+}
+
+cl_int chunk_scan<cl_int, scan_add>::scan(cl_int const* input, cl_int* output, size_t n)
+{
+    return dispatch_scan(input, output, n);
+}
+
+void chunk_scan<cl_int, scan_add>::offset(cl_int* output, size_t n, cl_int carry)
+{
+    dispatch_offset(output, n, carry);
+}
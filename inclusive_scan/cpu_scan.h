@@ -0,0 +1,150 @@
+#ifndef CPU_SCAN_H
+#define CPU_SCAN_H
+
+#include "scan.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Fixed set of worker threads. run() hands out task indices to the workers
+// and to the calling thread and returns once every task is done. Calls to
+// run() from different threads take turns.
+class ThreadPool
+{
+public:
+    // threads of 0 uses one thread per hardware thread, the caller included.
+    explicit ThreadPool(size_t threads = 0);
+    ~ThreadPool();
+
+    ThreadPool(ThreadPool const&) = delete;
+    ThreadPool& operator=(ThreadPool const&) = delete;
+
+    // Threads taking part in run(), the caller included.
+    size_t size() const { return workers_.size() + 1; }
+
+    void run(size_t tasks, std::function<void(size_t)> const& task);
+
+private:
+    void work();
+    // Runs tasks of the current run until none are left, with mutex_ held
+    // on entry and exit.
+    void drain(std::unique_lock<std::mutex>& lock);
+
+    std::vector<std::thread> workers_;
+    std::mutex run_mutex_; // held for a whole run()
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    std::function<void(size_t)> const* task_ = nullptr;
+    size_t tasks_ = 0;
+    size_t next_ = 0;
+    size_t pending_ = 0;
+    unsigned generation_ = 0;
+    bool stop_ = false;
+};
+
+// Pool shared by all CPU scans, created on first use.
+ThreadPool& cpu_scan_pool();
+
+// Instruction sets the float and int sums have a path for, in order.
+enum class simd_isa { scalar, sse2, avx2 };
+
+// Best instruction set the running CPU supports.
+simd_isa cpu_simd_isa();
+
+// Instruction set the float and int sums use, cpu_simd_isa() unless set
+// lower, e.g. to check the other paths. Applies to every thread.
+simd_isa cpu_scan_isa();
+void set_cpu_scan_isa(simd_isa isa);
+char const* simd_isa_name(simd_isa isa);
+
+// Inclusive scan of one chunk and offset of a scanned chunk by the total of
+// the chunks before it. Specialized with SSE2/AVX2 in-register prefix sums,
+// chosen by cpu_scan_isa(), for float and int sums, scalar otherwise.
+template<typename T, typename Op>
+struct chunk_scan
+{
+    // Scans n > 0 elements of input into output and returns the last one.
+    static T scan(T const* input, T* output, size_t n)
+    {
+        Op op;
+        T running = output[0] = input[0];
+        for (size_t i = 1; i < n; i++) {
+            output[i] = running = op(running, input[i]);
+        }
+        return running;
+    }
+
+    static void offset(T* output, size_t n, T carry)
+    {
+        Op op;
+        for (size_t i = 0; i < n; i++) {
+            output[i] = op(carry, output[i]);
+        }
+    }
+};
+
+template<> struct chunk_scan<cl_float, scan_add>
+{
+    static cl_float scan(cl_float const* input, cl_float* output, size_t n);
+    static void offset(cl_float* output, size_t n, cl_float carry);
+};
+
+template<> struct chunk_scan<cl_int, scan_add>
+{
+    static cl_int scan(cl_int const* input, cl_int* output, size_t n);
+    static void offset(cl_int* output, size_t n, cl_int carry);
+};
+
+// Smallest chunk worth a thread of its own.
+size_t const cpu_scan_grain = 1 << 16;
+
+// Inclusive scan of size host elements of input into output, which may be
+// the same array, over cpu_scan_pool(). Each thread scans its own chunk and
+// keeps the chunk's total, the totals are scanned serially, and each thread
+// then offsets its chunk by the total of the chunks before it. Float sums
+// come out in a different association order than a serial loop.
+template<typename T, typename Op = scan_add>
+void cpu_scan(T const* input, T* output, size_t size)
+{
+    if (size == 0) {
+        return;
+    }
+    ThreadPool& pool = cpu_scan_pool();
+    size_t const chunks = std::max<size_t>(1, std::min(pool.size(), size / cpu_scan_grain));
+    size_t const chunk_size = (size + chunks - 1) / chunks;
+
+    std::vector<T> totals(chunks);
+    pool.run(chunks, [&](size_t k) {
+        size_t const begin = k * chunk_size;
+        size_t const n = std::min(chunk_size, size - begin);
+        totals[k] = chunk_scan<T, Op>::scan(input + begin, output + begin, n);
+    });
+    if (chunks == 1) {
+        return;
+    }
+
+    Op op;
+    for (size_t k = 1; k < chunks; k++) {
+        totals[k] = op(totals[k - 1], totals[k]);
+    }
+    pool.run(chunks - 1, [&](size_t k) {
+        size_t const begin = (k + 1) * chunk_size;
+        size_t const n = std::min(chunk_size, size - begin);
+        chunk_scan<T, Op>::offset(output + begin, n, totals[k]);
+    });
+}
+
+template<typename T, typename Op = scan_add>
+std::vector<T> cpu_scan(std::vector<T> const& input)
+{
+    std::vector<T> output(input.size());
+    cpu_scan<T, Op>(input.data(), output.data(), input.size());
+    return output;
+}
+
+#endif // CPU_SCAN_H
@@ -0,0 +1,51 @@
+#include "fenwick_tree.h"
+
+static size_t global_size_for(ScanProgram const& program, size_t count)
+{
+    return (count / program.block_size + ((count % program.block_size)?1:0)) * program.block_size;
+}
+
+FenwickTree::FenwickTree(ScanProgram const& program, cl::Buffer input, size_t input_size)
+    : program_(program)
+    , size_(input_size)
+    , tree_(context, CL_MEM_READ_WRITE, program.element_size * input_size)
+{
+    std::vector<cl::Event> built(1);
+    queue.enqueueCopyBuffer(input, tree_, 0, 0, program.element_size * input_size, nullptr, &built[0]);
+
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , unsigned int
+            , unsigned int >(program_.kernel("fenwick_build"));
+
+    for (size_t step = 1; 2 * step <= size_; step *= 2) {
+        cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, built, cl::NDRange(global_size_for(program_, size_ / (2 * step))), cl::NDRange(program_.block_size));
+        built[0] = kernel(enqueue_args, tree_, size_, step);
+    }
+    built[0].wait();
+}
+
+cl::Event FenwickTree::update(cl::Buffer indices, cl::Buffer deltas, size_t count,
+                              std::vector<cl::Event> const& wait_list)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , unsigned int
+            , cl::Buffer&
+            , cl::Buffer&
+            , unsigned int >(program_.kernel("fenwick_update"));
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(global_size_for(program_, count)), cl::NDRange(program_.block_size));
+    return kernel(enqueue_args, tree_, size_, indices, deltas, count);
+}
+
+cl::Event FenwickTree::query(cl::Buffer indices, cl::Buffer results, size_t count,
+                             std::vector<cl::Event> const& wait_list)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , unsigned int
+            , cl::Buffer&
+            , cl::Buffer&
+            , unsigned int >(program_.kernel("fenwick_query"));
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(global_size_for(program_, count)), cl::NDRange(program_.block_size));
+    return kernel(enqueue_args, tree_, size_, indices, results, count);
+}
@@ -0,0 +1,43 @@
+#ifndef FENWICK_TREE_H
+#define FENWICK_TREE_H
+
+#include "scan.h"
+
+// Device-resident Fenwick tree for prefix sums of an array that changes a
+// few elements at a time: batches of point updates and prefix queries cost
+// O(log n) per entry instead of a full rescan. The program must be an add
+// program, e.g. scan_program<cl_int, scan_add>(). Updates of 8-byte types
+// need cl_khr_int64_base_atomics.
+class FenwickTree
+{
+public:
+    // Builds the tree over input_size elements of input, one launch per
+    // level.
+    FenwickTree(ScanProgram const& program, cl::Buffer input, size_t input_size);
+
+    // Adds deltas[k] to element indices[k] for k < count. indices holds
+    // cl_uints, deltas elements of the program's type.
+    cl::Event update(cl::Buffer indices, cl::Buffer deltas, size_t count,
+                     std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+    // Writes the inclusive prefix sum up to element indices[k] to results[k].
+    // Indices past the end give the sum of all elements.
+    cl::Event query(cl::Buffer indices, cl::Buffer results, size_t count,
+                    std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+    cl::Buffer tree() const { return tree_; }
+    size_t size() const { return size_; }
+
+private:
+    ScanProgram program_;
+    size_t size_;
+    cl::Buffer tree_;
+};
+
+template<typename T>
+FenwickTree fenwick_tree(cl::Buffer input, size_t input_size)
+{
+    return FenwickTree(scan_program<T, scan_add>(), input, input_size);
+}
+
+#endif // FENWICK_TREE_H
@@ -1,66 +1,788 @@
-#define SWAP(a,b) {__local float * tmp=a; a=b; b=tmp;}
+// Element type and associative operator are chosen at build time:
+// -DSCAN_T=<type> and one of -DSCAN_OP_ADD/MUL/MAX/MIN, with SCAN_IDENTITY the
+// operator's identity for that type. SCAN_FP64 enables double support and
+// SCAN_64BIT marks 8-byte element types.
+#ifdef SCAN_FP64
+#pragma OPENCL EXTENSION cl_khr_fp64 : enable
+#endif
 
-void threat_subblock(uint block_size, uint local_id,
-		             __global float* input, __global float* output,
-				     __local float* a_tmp, __local float* b_tmp)
+#ifndef SCAN_T
+#define SCAN_T float
+#endif
+typedef SCAN_T T;
+
+#if defined(SCAN_OP_MUL)
+#define OP(a, b) ((a) * (b))
+#elif defined(SCAN_OP_MAX)
+#define OP(a, b) max(a, b)
+#elif defined(SCAN_OP_MIN)
+#define OP(a, b) min(a, b)
+#else
+#define OP(a, b) ((a) + (b))
+#endif
+
+// Built-in collective scans, enabled by the host when the device has them:
+// SCAN_WORK_GROUP_SCAN for work_group_scan_* (OpenCL C 2.0, optional in
+// 3.0), otherwise SCAN_SUB_GROUP_SCAN for sub_group_scan_* (cl_khr_subgroups
+// or cl_intel_subgroups). There is no multiplicative built-in, so mul
+// programs always use the local-memory trees.
+#if defined(SCAN_OP_MAX)
+#define COLLECTIVE(f) f##_max
+#elif defined(SCAN_OP_MIN)
+#define COLLECTIVE(f) f##_min
+#elif !defined(SCAN_OP_MUL)
+#define COLLECTIVE(f) f##_add
+#endif
+
+#if defined(COLLECTIVE) && defined(SCAN_WORK_GROUP_SCAN) \
+	&& (__OPENCL_C_VERSION__ < 300 || defined(__opencl_c_work_group_collective_functions))
+#define USE_WORK_GROUP_SCAN
+#elif defined(COLLECTIVE) && defined(SCAN_SUB_GROUP_SCAN)
+#define USE_SUB_GROUP_SCAN
+#ifdef cl_khr_subgroups
+#pragma OPENCL EXTENSION cl_khr_subgroups : enable
+#endif
+#ifdef cl_intel_subgroups
+#pragma OPENCL EXTENSION cl_intel_subgroups : enable
+#endif
+#endif
+
+#ifndef SCAN_IDENTITY
+#define SCAN_IDENTITY 0
+#endif
+#define IDENTITY ((T)(SCAN_IDENTITY))
+
+// Elementwise transforms fused into the scans, defined by the host ahead of
+// this source for programs built with a ScanTransform: SCAN_LOAD(x) maps each
+// input element as it is read, SCAN_STORE(x) each result as it is written.
+// The block totals above the first level are scanned by the program without
+// them, so only the first level's reads and the final writes are mapped.
+#ifndef SCAN_LOAD
+#define SCAN_LOAD(x) (x)
+#endif
+#ifndef SCAN_STORE
+#define SCAN_STORE(x) (x)
+#endif
+
+#define SWAP(a,b) {__local T * tmp=a; a=b; b=tmp;}
+
+// Optional bank-conflict-free layout of the local scan arrays: SCAN_PAD_BANKS
+// inserts a pad element after every 2^LOG_NUM_BANKS entries, so the strided
+// accesses of the scan trees spread over all banks. The host sizes local
+// buffers of n entries to n + (n >> LOG_NUM_BANKS) then.
+#ifndef LOG_NUM_BANKS
+#define LOG_NUM_BANKS 5
+#endif
+#ifdef SCAN_PAD_BANKS
+#define PAD(i) ((i) + ((i) >> LOG_NUM_BANKS))
+#else
+#define PAD(i) (i)
+#endif
+
+// Elements scanned serially in registers by each work-item of the blocked
+// kernels; set by the host at build time.
+#ifndef ITEMS_PER_THREAD
+#define ITEMS_PER_THREAD 1
+#endif
+
+T block_scan_exclusive(uint block_size, uint local_id, T value, __local T* tmp);
+
+// Hillis-Steele scan of the count <= block_size elements of one block. a_tmp
+// and b_tmp hold block_size elements each; slots past count are padded with
+// the identity so every work-item takes part in the barriers. With built-in
+// scans available the ping-pong is replaced by one collective call. Results
+// go through SCAN_STORE if map_output is set.
+void threat_subblock(uint block_size, uint local_id, uint count,
+		             __global T* input, __global T* output,
+				     __local T* a_tmp, __local T* b_tmp, uint map_output)
 {
-    a_tmp[local_id] = b_tmp[local_id] = input[local_id];
+#if defined(USE_WORK_GROUP_SCAN) || defined(USE_SUB_GROUP_SCAN)
+    T value = local_id < count ? SCAN_LOAD(input[local_id]) : IDENTITY;
+    value = OP(block_scan_exclusive(block_size, local_id, value, a_tmp), value);
+    if (local_id < count)
+    {
+        output[local_id] = map_output ? SCAN_STORE(value) : value;
+    }
+#else
+    a_tmp[PAD(local_id)] = b_tmp[PAD(local_id)] = local_id < count ? SCAN_LOAD(input[local_id]) : IDENTITY;
     barrier(CLK_LOCAL_MEM_FENCE);
  
     for(uint s = 1; s < block_size; s <<= 1)
     {
         if(local_id > (s - 1))
         {
-            b_tmp[local_id] = a_tmp[local_id] + a_tmp[local_id - s];
+            b_tmp[PAD(local_id)] = OP(a_tmp[PAD(local_id - s)], a_tmp[PAD(local_id)]);
         }
         else
         {
-            b_tmp[local_id] = a_tmp[local_id];
+            b_tmp[PAD(local_id)] = a_tmp[PAD(local_id)];
         }
         barrier(CLK_LOCAL_MEM_FENCE);
         SWAP(a_tmp, b_tmp);
     }
-    output[local_id] = a_tmp[local_id];
+    if (local_id < count)
+    {
+        T value = a_tmp[PAD(local_id)];
+        output[local_id] = map_output ? SCAN_STORE(value) : value;
+    }
+#endif
+}
+
+uint next_pow2(uint x)
+{
+	uint p = 1;
+	while (p < x) p <<= 1;
+	return p;
+}
+
+// Work-efficient (Blelloch) scan of one block: up-sweep builds a reduction tree
+// in place, down-sweep turns it into an exclusive scan. Needs a single local
+// buffer of next_pow2(block_size) entries (see PAD); slots past block_size
+// are filled with the identity.
+// Returns the exclusive prefix of value, the element owned by local_id.
+T block_scan_blelloch(uint block_size, uint local_id, T value, __local T* tmp)
+{
+	uint n = next_pow2(block_size);
+	tmp[PAD(local_id)] = value;
+	for (uint i = local_id + block_size; i < n; i += block_size)
+		tmp[PAD(i)] = IDENTITY;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint offset = 1;
+	for (uint d = n >> 1; d > 0; d >>= 1)
+	{
+		for (uint k = local_id; k < d; k += block_size)
+		{
+			uint ai = PAD(offset * (2 * k + 1) - 1);
+			uint bi = PAD(offset * (2 * k + 2) - 1);
+			tmp[bi] = OP(tmp[ai], tmp[bi]);
+		}
+		offset <<= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (local_id == 0) tmp[PAD(n - 1)] = IDENTITY;
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint d = 1; d < n; d <<= 1)
+	{
+		offset >>= 1;
+		for (uint k = local_id; k < d; k += block_size)
+		{
+			uint ai = PAD(offset * (2 * k + 1) - 1);
+			uint bi = PAD(offset * (2 * k + 2) - 1);
+			T t = tmp[ai];
+			tmp[ai] = tmp[bi];
+			tmp[bi] = OP(tmp[bi], t);
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	return tmp[PAD(local_id)];
+}
+
+// Loads the ITEMS_PER_THREAD contiguous elements owned by local_id; elements
+// past count read as the identity. Full runs of four go through vload4.
+void load_items(uint local_id, uint count, __global T* input, T* items)
+{
+	uint first = local_id * ITEMS_PER_THREAD;
+#if ITEMS_PER_THREAD % 4 == 0
+	if (first + ITEMS_PER_THREAD <= count)
+	{
+		for (uint i = 0; i < ITEMS_PER_THREAD; i += 4)
+			vstore4(vload4(0, input + first + i), 0, items + i);
+		return;
+	}
+#endif
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		items[i] = (first + i < count) ? input[first + i] : IDENTITY;
+}
+
+void store_items(uint local_id, uint count, __global T* output, T* items)
+{
+	uint first = local_id * ITEMS_PER_THREAD;
+#if ITEMS_PER_THREAD % 4 == 0
+	if (first + ITEMS_PER_THREAD <= count)
+	{
+		for (uint i = 0; i < ITEMS_PER_THREAD; i += 4)
+			vstore4(vload4(0, items + i), 0, output + first + i);
+		return;
+	}
+#endif
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		if (first + i < count) output[first + i] = items[i];
+}
+
+// Applies SCAN_LOAD to the first count elements of a tile after load_items,
+// leaving the identity padding alone, and SCAN_STORE before store_items.
+void map_loaded(uint local_id, uint count, T* items)
+{
+	uint first = local_id * ITEMS_PER_THREAD;
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		if (first + i < count) items[i] = SCAN_LOAD(items[i]);
+}
+
+void map_stored(T* items)
+{
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		items[i] = SCAN_STORE(items[i]);
+}
+
+// Turns the inclusive scan of a work-item's items into an exclusive one;
+// first is the prefix of everything before them.
+void shift_items(T* items, T first)
+{
+	for (uint i = ITEMS_PER_THREAD - 1; i > 0; i--)
+		items[i] = items[i - 1];
+	items[0] = first;
+}
+
+// Exclusive scan of one value per work-item across the work-group, through
+// the built-in collectives when they are enabled. tmp has room for one
+// element per work-item, so also for one per sub-group.
+T block_scan_exclusive(uint block_size, uint local_id, T value, __local T* tmp)
+{
+#if defined(USE_WORK_GROUP_SCAN)
+	return COLLECTIVE(work_group_scan_exclusive)(value);
+#elif defined(USE_SUB_GROUP_SCAN)
+	uint sub_group = get_sub_group_id();
+	uint sub_groups = get_num_sub_groups();
+	uint lane = get_sub_group_local_id();
+	uint width = get_sub_group_size();
+
+	T prefix = COLLECTIVE(sub_group_scan_exclusive)(value);
+	if (lane + 1 == width) tmp[sub_group] = OP(prefix, value);
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	// the first sub-group scans the sub-group totals, width at a time
+	if (sub_group == 0)
+	{
+		T carry = IDENTITY;
+		for (uint base = 0; base < sub_groups; base += width)
+		{
+			T total = base + lane < sub_groups ? tmp[base + lane] : IDENTITY;
+			T scanned = COLLECTIVE(sub_group_scan_exclusive)(total);
+			if (base + lane < sub_groups) tmp[base + lane] = OP(carry, scanned);
+			carry = OP(carry, sub_group_broadcast(OP(scanned, total), width - 1));
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	T result = OP(tmp[sub_group], prefix);
+	barrier(CLK_LOCAL_MEM_FENCE);
+	return result;
+#else
+	return block_scan_blelloch(block_size, local_id, value, tmp);
+#endif
 }
 
-__kernel void subblock_scan(__global float* input, __global float* output, __global float* last_elements,
-							__local float* a_tmp, __local float* b_tmp,
+// Scans a tile of block_size * ITEMS_PER_THREAD elements held in registers:
+// each work-item scans its own items serially and joins the block scan
+// with its partial only. *prefix receives the work-item's exclusive
+// prefix within the tile. Returns the tile total, which is valid in the last
+// work-item.
+T tile_scan(uint block_size, uint local_id, T* items, __local T* tmp, T* prefix)
+{
+	for (uint i = 1; i < ITEMS_PER_THREAD; i++)
+		items[i] = OP(items[i - 1], items[i]);
+	T partial = items[ITEMS_PER_THREAD - 1];
+	T exclusive = block_scan_exclusive(block_size, local_id, partial, tmp);
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		items[i] = OP(exclusive, items[i]);
+	*prefix = exclusive;
+	return items[ITEMS_PER_THREAD - 1];
+}
+
+// Blocked scan of the first count elements of a tile, inclusive or exclusive.
+// The returned total is taken before SCAN_STORE.
+T threat_subblock_blelloch(uint block_size, uint local_id, uint count,
+                           __global T* input, __global T* output,
+                           __local T* tmp, uint exclusive, uint map_output)
+{
+	T items[ITEMS_PER_THREAD];
+	T prefix;
+	load_items(local_id, count, input, items);
+	map_loaded(local_id, count, items);
+	T total = tile_scan(block_size, local_id, items, tmp, &prefix);
+	if (exclusive) shift_items(items, prefix);
+	if (map_output) map_stored(items);
+	store_items(local_id, count, output, items);
+	return total;
+}
+
+__kernel void subblock_scan(__global T* input, __global T* output, __global T* last_elements,
+							__local T* a_tmp, __local T* b_tmp,
 							uint input_size)
 {
-	uint global_id = get_global_id(0);
 	uint group_id = get_group_id(0);
 	uint group_size = get_local_size(0);
 	uint local_id = get_local_id(0);
 
-	if (global_id >= input_size) return;
-	
 	uint offset = group_id * group_size;
-	threat_subblock(group_size, local_id, input + offset, output + offset, a_tmp + offset, b_tmp + offset);
-	if (local_id + 1 == group_size || global_id + 1 == input_size)
+	uint count = min(group_size, input_size - offset);
+	threat_subblock(group_size, local_id, count, input + offset, output + offset, a_tmp, b_tmp, 0);
+	if (local_id + 1 == count)
 	{
 		last_elements[group_id] = output[offset + local_id];
 	}
 }
 
-__kernel void small_array_scan(__global float* input, __global float* output,
-		                       __local float* a_tmp, __local float* b_tmp)
+__kernel void small_array_scan(__global T* input, __global T* output,
+		                       __local T* a_tmp, __local T* b_tmp)
+{
+	uint group_size = get_local_size(0);
+	uint local_id = get_local_id(0);
+	threat_subblock(group_size, local_id, group_size, input, output, a_tmp, b_tmp, 1);
+}
+
+__kernel void subblock_scan_blelloch(__global T* input, __global T* output, __global T* last_elements,
+									__local T* tmp, uint input_size, uint exclusive)
 {
+	uint group_id = get_group_id(0);
 	uint group_size = get_local_size(0);
 	uint local_id = get_local_id(0);
-	threat_subblock(group_size, local_id, input, output, a_tmp, b_tmp);
+
+	uint offset = group_id * group_size * ITEMS_PER_THREAD;
+	uint count = min(group_size * ITEMS_PER_THREAD, input_size - offset);
+	T total = threat_subblock_blelloch(group_size, local_id, count, input + offset, output + offset, tmp, exclusive, 0);
+	if (local_id + 1 == group_size)
+	{
+		last_elements[group_id] = total;
+	}
 }
 
-__kernel void merge(__global float* input, __global float* output, __global float* additions, uint input_size)
+__kernel void small_array_scan_blelloch(__global T* input, __global T* output, __local T* tmp,
+										uint input_size, uint exclusive)
+{
+	uint group_size = get_local_size(0);
+	uint local_id = get_local_id(0);
+	threat_subblock_blelloch(group_size, local_id, input_size, input, output, tmp, exclusive, 1);
+}
+
+// additions[k] is the inclusive prefix of tile k; tiles are tile_size elements.
+__kernel void merge(__global T* input, __global T* output, __global T* additions,
+					uint input_size, uint tile_size)
 {
 	uint global_id = get_global_id(0);
+	uint tile_id = global_id / tile_size;
+
+	if (global_id >= input_size) return;
+
+	if (tile_id > 0) {
+		output[global_id] = SCAN_STORE(OP(additions[tile_id - 1], input[global_id]));
+	}
+	else {
+		output[global_id] = SCAN_STORE(input[global_id]);
+	}
+}
+
+// Scans one whole array with one work-group, tile by tile, carrying the
+// running total between tiles; arrays up to one tile take a single pass.
+// carry is a __local slot for broadcasting that total. In-place is safe.
+void scan_array(uint group_size, uint local_id, uint length,
+                __global T* input, __global T* output,
+                __local T* tmp, __local T* carry, uint exclusive)
+{
+	uint tile = group_size * ITEMS_PER_THREAD;
+	T running = IDENTITY;
+	for (uint offset = 0; offset < length; offset += tile)
+	{
+		uint count = min(tile, length - offset);
+		T items[ITEMS_PER_THREAD];
+		T prefix;
+		load_items(local_id, count, input + offset, items);
+		T total = tile_scan(group_size, local_id, items, tmp, &prefix);
+		if (exclusive) shift_items(items, prefix);
+		for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+			items[i] = OP(running, items[i]);
+		store_items(local_id, count, output + offset, items);
+
+		if (local_id + 1 == group_size) *carry = OP(running, total);
+		barrier(CLK_LOCAL_MEM_FENCE);
+		running = *carry;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+}
+
+// Batched scans, one independent array per work-group. Array k is either
+// length elements at k * stride, or [offsets[k], offsets[k + 1]).
+__kernel void batched_scan_strided(__global T* input, __global T* output, __local T* tmp,
+								   uint stride, uint length, uint exclusive)
+{
+	__local T carry;
+	uint start = get_group_id(0) * stride;
+	scan_array(get_local_size(0), get_local_id(0), length,
+			   input + start, output + start, tmp, &carry, exclusive);
+}
+
+__kernel void batched_scan_offsets(__global T* input, __global T* output, __global uint* offsets,
+								   __local T* tmp, uint exclusive)
+{
+	__local T carry;
+	uint array = get_group_id(0);
+	uint start = offsets[array];
+	scan_array(get_local_size(0), get_local_id(0), offsets[array + 1] - start,
+			   input + start, output + start, tmp, &carry, exclusive);
+}
+
+// Adds the running total of everything before a chunk to the chunk's scan,
+// writing it to output[output_offset...], and hands on the new running total.
+// input may equal output. carry_in and carry_out hold one element each;
+// carry_in is ignored for the first chunk.
+__kernel void apply_carry(__global T* input, __global T* output, __global T* carry_in, __global T* carry_out,
+						  uint size, uint output_offset, uint first)
+{
+	uint global_id = get_global_id(0);
+
+	if (global_id >= size) return;
+
+	T value = input[global_id];
+	if (!first) {
+		value = OP(carry_in[0], value);
+	}
+	output[output_offset + global_id] = value;
+	if (global_id + 1 == size) {
+		carry_out[0] = value;
+	}
+}
+
+#define FLAG_NOT_READY 0
+#define FLAG_AGGREGATE 1
+#define FLAG_PREFIX    2
+
+// Single-pass scan with decoupled look-back. Every work-group scans its tile,
+// publishes the tile aggregate, then walks back over its predecessors adding
+// aggregates until it meets a published inclusive prefix, and finally publishes
+// its own inclusive prefix. flags holds one status word per tile followed by
+// the tile counter; all of it must be zero before the launch.
+// Tiles are numbered in the order work-groups start, so a group only ever waits
+// on groups that are already running. This still relies on running work-groups
+// making forward progress, which not every device guarantees.
+__kernel void single_pass_scan(__global T* input, __global T* output,
+							   volatile __global uint* flags,
+							   volatile __global T* aggregates,
+							   volatile __global T* prefixes,
+							   __local T* tmp, uint input_size, uint exclusive)
+{
+	__local uint tile_id;
+	__local T exclusive_prefix;
+
+	uint group_size = get_local_size(0);
+	uint local_id = get_local_id(0);
+
+	if (local_id == 0)
+	{
+		tile_id = atomic_inc(flags + get_num_groups(0));
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+	uint tile = tile_id;
+
+	uint offset = tile * group_size * ITEMS_PER_THREAD;
+	uint count = min(group_size * ITEMS_PER_THREAD, input_size - offset);
+	T items[ITEMS_PER_THREAD];
+	T prefix;
+	load_items(local_id, count, input + offset, items);
+	map_loaded(local_id, count, items);
+	T total = tile_scan(group_size, local_id, items, tmp, &prefix);
+
+	if (local_id + 1 == group_size)
+	{
+		T aggregate = total;
+		if (tile == 0)
+		{
+			prefixes[0] = aggregate;
+			mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(flags, FLAG_PREFIX);
+			exclusive_prefix = IDENTITY;
+		}
+		else
+		{
+			aggregates[tile] = aggregate;
+			mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(flags + tile, FLAG_AGGREGATE);
+
+			T predecessor = IDENTITY;
+			uint i = tile - 1;
+			for (;;)
+			{
+				uint flag = atomic_or(flags + i, 0);
+				if (flag == FLAG_NOT_READY) continue;
+				mem_fence(CLK_GLOBAL_MEM_FENCE);
+				if (flag == FLAG_PREFIX)
+				{
+					predecessor = OP(prefixes[i], predecessor);
+					break;
+				}
+				predecessor = OP(aggregates[i], predecessor);
+				--i;
+			}
+
+			prefixes[tile] = OP(predecessor, aggregate);
+			mem_fence(CLK_GLOBAL_MEM_FENCE);
+			atomic_xchg(flags + tile, FLAG_PREFIX);
+			exclusive_prefix = predecessor;
+		}
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	if (exclusive) shift_items(items, prefix);
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		items[i] = OP(exclusive_prefix, items[i]);
+	map_stored(items);
+	store_items(local_id, count, output + offset, items);
+}
+
+// Segmented scan: heads holds one flag per element, non-zero where a new
+// segment starts. It is an ordinary scan over (head, value) pairs under
+//   (fa, va) . (fb, vb) = (fa | fb, fb ? vb : OP(va, vb)),
+// which is associative, so the Blelloch tree works on pairs unchanged.
+
+// Exclusive block scan of (head, value) pairs, in place in *head and *value.
+void block_scan_segmented(uint block_size, uint local_id, uint* head, T* value,
+                          __local uint* htmp, __local T* tmp)
+{
+	uint n = next_pow2(block_size);
+	htmp[PAD(local_id)] = *head;
+	tmp[PAD(local_id)] = *value;
+	for (uint i = local_id + block_size; i < n; i += block_size)
+	{
+		htmp[PAD(i)] = 0;
+		tmp[PAD(i)] = IDENTITY;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	uint offset = 1;
+	for (uint d = n >> 1; d > 0; d >>= 1)
+	{
+		for (uint k = local_id; k < d; k += block_size)
+		{
+			uint ai = PAD(offset * (2 * k + 1) - 1);
+			uint bi = PAD(offset * (2 * k + 2) - 1);
+			if (!htmp[bi]) tmp[bi] = OP(tmp[ai], tmp[bi]);
+			htmp[bi] |= htmp[ai];
+		}
+		offset <<= 1;
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	if (local_id == 0)
+	{
+		htmp[PAD(n - 1)] = 0;
+		tmp[PAD(n - 1)] = IDENTITY;
+	}
+	barrier(CLK_LOCAL_MEM_FENCE);
+
+	for (uint d = 1; d < n; d <<= 1)
+	{
+		offset >>= 1;
+		for (uint k = local_id; k < d; k += block_size)
+		{
+			uint ai = PAD(offset * (2 * k + 1) - 1);
+			uint bi = PAD(offset * (2 * k + 2) - 1);
+			uint left_head = htmp[ai];
+			T left = tmp[ai];
+			htmp[ai] = htmp[bi];
+			tmp[ai] = tmp[bi];
+			if (!left_head) left = OP(tmp[bi], left);
+			htmp[bi] |= left_head;
+			tmp[bi] = left;
+		}
+		barrier(CLK_LOCAL_MEM_FENCE);
+	}
+
+	*head = htmp[PAD(local_id)];
+	*value = tmp[PAD(local_id)];
+}
+
+void load_heads(uint local_id, uint count, __global uint* heads, uint* items)
+{
+	uint first = local_id * ITEMS_PER_THREAD;
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		items[i] = (first + i < count) ? heads[first + i] : 0;
+}
+
+// Segmented scan of one tile in registers. On return items hold the inclusive
+// (or exclusive) segmented scan and seen[i] is set if a segment starts at or
+// before item i within the tile. Returns the tile total with its head flag in
+// *tile_head, both valid in the last work-item.
+T tile_scan_segmented(uint block_size, uint local_id, T* items, uint* heads, uint* seen,
+                      __local uint* htmp, __local T* tmp, uint exclusive, uint* tile_head)
+{
+	seen[0] = heads[0];
+	for (uint i = 1; i < ITEMS_PER_THREAD; i++)
+	{
+		if (!heads[i]) items[i] = OP(items[i - 1], items[i]);
+		seen[i] = seen[i - 1] | heads[i];
+	}
+
+	uint prefix_head = seen[ITEMS_PER_THREAD - 1];
+	T prefix = items[ITEMS_PER_THREAD - 1];
+	block_scan_segmented(block_size, local_id, &prefix_head, &prefix, htmp, tmp);
+
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+	{
+		if (!seen[i]) items[i] = OP(prefix, items[i]);
+		seen[i] |= prefix_head;
+	}
+	*tile_head = seen[ITEMS_PER_THREAD - 1];
+	T total = items[ITEMS_PER_THREAD - 1];
+
+	if (exclusive)
+	{
+		shift_items(items, prefix);
+		for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+			if (heads[i]) items[i] = IDENTITY;
+	}
+	return total;
+}
+
+__kernel void subblock_segmented_scan(__global T* input, __global uint* heads,
+									  __global T* output, __global uint* seen,
+									  __global T* last_elements, __global uint* last_heads,
+									  __local uint* htmp, __local T* tmp,
+									  uint input_size, uint exclusive)
+{
 	uint group_id = get_group_id(0);
+	uint group_size = get_local_size(0);
+	uint local_id = get_local_id(0);
+
+	uint offset = group_id * group_size * ITEMS_PER_THREAD;
+	uint count = min(group_size * ITEMS_PER_THREAD, input_size - offset);
+	T items[ITEMS_PER_THREAD];
+	uint item_heads[ITEMS_PER_THREAD];
+	uint item_seen[ITEMS_PER_THREAD];
+	uint tile_head;
+	load_items(local_id, count, input + offset, items);
+	load_heads(local_id, count, heads + offset, item_heads);
+	T total = tile_scan_segmented(group_size, local_id, items, item_heads, item_seen,
+								  htmp, tmp, exclusive, &tile_head);
+	store_items(local_id, count, output + offset, items);
+
+	uint first = local_id * ITEMS_PER_THREAD;
+	for (uint i = 0; i < ITEMS_PER_THREAD; i++)
+		if (first + i < count) seen[offset + first + i] = item_seen[i];
+
+	if (local_id + 1 == group_size)
+	{
+		last_elements[group_id] = total;
+		last_heads[group_id] = tile_head;
+	}
+}
+
+__kernel void small_array_segmented_scan(__global T* input, __global uint* heads, __global T* output,
+										 __local uint* htmp, __local T* tmp,
+										 uint input_size, uint exclusive)
+{
+	uint group_size = get_local_size(0);
+	uint local_id = get_local_id(0);
+
+	T items[ITEMS_PER_THREAD];
+	uint item_heads[ITEMS_PER_THREAD];
+	uint item_seen[ITEMS_PER_THREAD];
+	uint tile_head;
+	load_items(local_id, input_size, input, items);
+	load_heads(local_id, input_size, heads, item_heads);
+	tile_scan_segmented(group_size, local_id, items, item_heads, item_seen,
+						htmp, tmp, exclusive, &tile_head);
+	store_items(local_id, input_size, output, items);
+}
+
+// Like merge, but the carry from earlier tiles stops at the first segment
+// head inside the tile.
+__kernel void segmented_merge(__global T* input, __global T* output, __global uint* seen,
+							  __global T* additions, uint input_size, uint tile_size)
+{
+	uint global_id = get_global_id(0);
+	uint tile_id = global_id / tile_size;
 
 	if (global_id >= input_size) return;
 
-	if (group_id > 0) {
-		output[global_id] = input[global_id] + additions[group_id - 1];
+	if (tile_id > 0 && !seen[global_id]) {
+		output[global_id] = OP(additions[tile_id - 1], input[global_id]);
 	}
 	else {
 		output[global_id] = input[global_id];
 	}
 }
+
+// Atomic OP on global memory for any element type, as a compare-and-swap
+// loop on the element's bits. 64-bit types need cl_khr_int64_base_atomics;
+// without it the kernels using atomic_op are left out of the program.
+#ifdef SCAN_64BIT
+#ifdef cl_khr_int64_base_atomics
+#pragma OPENCL EXTENSION cl_khr_int64_base_atomics : enable
+#define HAVE_ATOMIC_OP
+typedef ulong bits_t;
+#define ATOMIC_CMPXCHG atom_cmpxchg
+#endif
+#else
+#define HAVE_ATOMIC_OP
+typedef uint bits_t;
+#define ATOMIC_CMPXCHG atomic_cmpxchg
+#endif
+
+#ifdef HAVE_ATOMIC_OP
+void atomic_op(volatile __global T* p, T value)
+{
+	union { T value; bits_t bits; } expected, desired;
+	volatile __global bits_t* bits = (volatile __global bits_t*)p;
+
+	expected.value = *p;
+	for (;;) {
+		desired.value = OP(expected.value, value);
+		bits_t const seen = ATOMIC_CMPXCHG(bits, expected.bits, desired.bits);
+		if (seen == expected.bits) break;
+		expected.bits = seen;
+	}
+}
+#endif
+
+// Fenwick tree over n elements: with 1-based i, tree[i - 1] holds the OP of
+// elements (i - lowbit(i), i]. These kernels are only meaningful for the add
+// programs.
+
+// One level of the bottom-up build, from a copy of the input: every node i
+// with lowbit(i) > step, which already holds (i - step, i], takes in node
+// i - step, which holds the step elements before. Nodes are summed from the
+// elements pairwise rather than as differences of prefixes, so float nodes
+// keep their precision however large the prefixes get.
+__kernel void fenwick_build(__global T* tree, uint n, uint step)
+{
+	uint i = (get_global_id(0) + 1) * 2 * step;
+
+	if (i > n) return;
+
+	tree[i - 1] = OP(tree[i - 1 - step], tree[i - 1]);
+}
+
+#ifdef HAVE_ATOMIC_OP
+// Adds deltas[k] to element indices[k], one work-item per update. Updates
+// of the same element in one batch are all applied.
+__kernel void fenwick_update(volatile __global T* tree, uint n,
+							 __global uint* indices, __global T* deltas, uint count)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count) return;
+
+	T delta = deltas[k];
+	for (uint i = indices[k] + 1; i <= n; i += i & -i) {
+		atomic_op(tree + i - 1, delta);
+	}
+}
+#endif
+
+// results[k] is the inclusive prefix up to element indices[k]; indices past
+// the end give the total of all n elements.
+__kernel void fenwick_query(__global T* tree, uint n, __global uint* indices, __global T* results, uint count)
+{
+	uint k = get_global_id(0);
+
+	if (k >= count) return;
+
+	T sum = IDENTITY;
+	for (uint i = min(indices[k], n - 1) + 1; i > 0; i -= i & -i) {
+		sum = OP(sum, tree[i - 1]);
+	}
+	results[k] = sum;
+}
@@ -1,5 +1,9 @@
-#define __CL_ENABLE_EXCEPTIONS
-#include "CL/cl.hpp"
+#include "scan.h"
+#include "streaming_scan.h"
+#include "fenwick_tree.h"
+#include "multi_device_scan.h"
+#include "scan_dispatcher.h"
+#include "cpu_scan.h"
 
 #include <iostream>
 #include <fstream>
@@ -11,6 +15,7 @@
 #include <chrono>
 #include <algorithm>
 #include <stdexcept>
+#include <functional>
 
 cl::Platform selectPlatform()
 {
@@ -72,98 +77,779 @@ cl::Device selectDevice(std::vector<cl::Device> const& devices)
     return devices[i];
 }
 
-std::vector<float> cpu_inclusive_scan(std::vector<float> const& input)
+template<typename T, typename Op = scan_add>
+std::vector<T> cpu_inclusive_scan(std::vector<T> const& input)
 {
-    std::vector<float> output(input);
-    for (int i = 1; i < output.size(); i++) {
-        output[i] += output[i - 1];
+    Op op;
+    std::vector<T> output(input);
+    for (size_t i = 1; i < output.size(); i++) {
+        output[i] = op(output[i - 1], output[i]);
     }
     return output;
 }
 
-void cpu_check(std::vector<float> input, std::vector<float> output)
+template<typename T, typename Op = scan_add>
+std::vector<T> cpu_exclusive_scan(std::vector<T> const& input, T identity)
 {
-    std::vector<float> cpu_output = cpu_inclusive_scan(input);
-    if (std::equal(output.begin(), output.end(), cpu_output.begin(), std::equal_to<double>())) {
+    Op op;
+    std::vector<T> output(input.size());
+    T running = identity;
+    for (size_t i = 0; i < input.size(); i++) {
+        output[i] = running;
+        running = op(running, input[i]);
+    }
+    return output;
+}
+
+template<typename T, typename Op = scan_add>
+std::vector<T> cpu_segmented_scan(std::vector<T> const& input, std::vector<cl_uint> const& heads)
+{
+    Op op;
+    std::vector<T> output(input);
+    for (size_t i = 1; i < output.size(); i++) {
+        if (!heads[i]) {
+            output[i] = op(output[i - 1], output[i]);
+        }
+    }
+    return output;
+}
+
+template<typename T>
+void print_check(std::vector<T> const& output, std::vector<T> const& expected)
+{
+    if (std::equal(output.begin(), output.end(), expected.begin(), std::equal_to<T>())) {
         std::cout << "Ok" << std::endl;
     } else {
         std::cout << "comparation failed" << std::endl;
     }
 }
 
-size_t const block_size = 256;
-cl::Program program;
-cl::Context context;
-cl::CommandQueue queue;
+template<typename T, typename Op = scan_add>
+void cpu_check(std::vector<T> input, std::vector<T> output)
+{
+    print_check(output, cpu_inclusive_scan<T, Op>(input));
+}
 
-cl::Buffer small_array_scan(cl::Buffer input, size_t input_size)
+// n digits from 0 to 9 of a generator seeded with seed, so a check sees the
+// same input on every run.
+template<typename T>
+std::vector<T> random_digits(size_t n, unsigned seed = 42)
 {
-    if (input_size > block_size) throw std::invalid_argument("input too big");
+    std::default_random_engine generator(seed);
+    std::uniform_int_distribution<int> digits(0, 9);
+    std::vector<T> values(n);
+    for (T& x: values) {
+        x = T(digits(generator));
+    }
+    return values;
+}
 
-    auto kernel = cl::make_kernel< cl::Buffer&
-            , cl::Buffer&
-            , cl::LocalSpaceArg
-            , cl::LocalSpaceArg >(program, "small_array_scan");
+// New buffer holding values, written before it is returned.
+template<typename T>
+cl::Buffer upload(std::vector<T> const& values, cl_mem_flags flags = CL_MEM_READ_ONLY)
+{
+    cl::Buffer buffer(context, flags, sizeof(T) * values.size());
+    queue.enqueueWriteBuffer(buffer, CL_TRUE, 0, sizeof(T) * values.size(), values.data());
+    return buffer;
+}
 
-    cl::Buffer output(context, CL_MEM_READ_WRITE, sizeof(float) * input_size);
-    auto enqueue_args = cl::EnqueueArgs(queue, cl::NDRange(input_size), cl::NDRange(input_size));
-    cl::Event event = kernel(enqueue_args, input, output,
-                             cl::Local(sizeof(float) * input_size), cl::Local(sizeof(float) * input_size));
-    event.wait();
-    return output;
+template<typename T>
+std::vector<T> read_buffer(cl::Buffer buffer, size_t size)
+{
+    std::vector<T> result(size);
+    queue.enqueueReadBuffer(buffer, CL_TRUE, 0, sizeof(T) * size, &result[0]);
+    return result;
 }
 
-std::pair<cl::Buffer, cl::Buffer> subblock_scan(cl::Buffer input, size_t input_size)
+// Runs both three-phase block scan algorithms and the single-pass scan on the
+// same random inputs through reused plans, plus inclusive_scan() which builds a
+// fresh plan per call and back-to-back enqueue() calls that only wait at the
+// end, and prints the average wall-clock time per scan.
+void benchmark()
 {
-    auto kernel = cl::make_kernel< cl::Buffer&
-            , cl::Buffer&
-            , cl::Buffer&
-            , cl::LocalSpaceArg
-            , cl::LocalSpaceArg
-            , unsigned int >(program, "subblock_scan");
-    size_t const global_size = (input_size / block_size + ((input_size % block_size)?1:0)) * block_size;
-    size_t const blocks_count = global_size / block_size;
-    cl::Buffer output(context, CL_MEM_READ_WRITE, sizeof(float) * input_size);
-    cl::Buffer last_elements(context, CL_MEM_READ_WRITE, sizeof(float) * blocks_count);
+    size_t const sizes[] = {64, 256, 1024, 4096, 16384, 1 << 18, 1 << 20};
+    int const iterations = 100;
+    std::default_random_engine generator(42);
+    std::uniform_int_distribution<int> distribution(0, 9);
+
+    enum class Launch { blocking, unplanned, async };
+    struct Variant
+    {
+        char const* name;
+        scan_mode mode;
+        scan_algorithm algorithm;
+        Launch launch;
+    };
+    Variant const variants[] = {
+        {"hillis-steele", scan_mode::three_phase, scan_algorithm::hillis_steele, Launch::blocking},
+        {"blelloch", scan_mode::three_phase, scan_algorithm::blelloch, Launch::blocking},
+        {"single-pass", scan_mode::single_pass, scan_algorithm::blelloch, Launch::blocking},
+        {"unplanned", selected_scan_mode, scan_algorithm::blelloch, Launch::unplanned},
+        {"async", selected_scan_mode, scan_algorithm::blelloch, Launch::async}
+    };
+
+    std::cout << std::setw(10) << "size";
+    for (Variant const& variant: variants) {
+        std::cout << std::setw(14) << variant.name;
+    }
+    std::cout << " (us per scan)" << std::endl;
 
-    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, cl::NDRange(global_size), cl::NDRange(block_size));
-    cl::Event event = kernel(enqueue_args, input, output, last_elements,
-                             cl::Local(sizeof(float) * input_size), cl::Local(sizeof(float) * input_size), input_size);
-    event.wait();
-    return std::make_pair(output, last_elements);
+    for (size_t input_size: sizes) {
+        std::vector<float> input(input_size);
+        for (float& x: input) {
+            x = distribution(generator);
+        }
+        cl::Buffer dev_input(context, CL_MEM_READ_ONLY, sizeof(float) * input_size);
+        queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(float) * input_size, &input[0]);
+
+        std::cout << std::setw(10) << input_size;
+        for (Variant const& variant: variants) {
+            try {
+                ScanPlan plan(scan_program<cl_float, scan_add>(), input_size, variant.mode, variant.algorithm);
+                auto scan = [&]{
+                    switch (variant.launch) {
+                    case Launch::blocking:
+                        plan.execute(dev_input);
+                        break;
+                    case Launch::unplanned:
+                        inclusive_scan(dev_input, input_size, variant.algorithm);
+                        break;
+                    case Launch::async:
+                        plan.enqueue(dev_input);
+                        break;
+                    }
+                };
+                scan();
+                queue.finish();
+                auto start = std::chrono::high_resolution_clock::now();
+                for (int i = 0; i < iterations; i++) {
+                    scan();
+                }
+                queue.finish();
+                auto end = std::chrono::high_resolution_clock::now();
+                double us = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+                std::cout << std::setw(14) << std::fixed << std::setprecision(1) << us;
+            }
+            catch (cl::Error const & e) {
+                std::cout << std::setw(14) << "failed";
+            }
+        }
+        std::cout << std::endl;
+    }
 }
 
-cl::Buffer merge(cl::Buffer input, cl::Buffer additions, size_t input_size)
+// Small float scans through one plan, launching the program's cached kernel
+// objects or creating every kernel afresh per launch as make_kernel with a
+// program and name does, and prints the average wall-clock time per scan.
+void benchmark_launch()
 {
-    auto kernel = cl::make_kernel< cl::Buffer&
-            , cl::Buffer&
-            , cl::Buffer&
-            , unsigned int >(program, "merge");
+    size_t const sizes[] = {64, 1024, 16384, 1 << 18};
+    int const iterations = 1000;
+    ScanProgram const& cached = scan_program<cl_float, scan_add>();
+    ScanProgram uncached = cached;
+    uncached.kernels.clear();
+    std::vector<ScanProgram const*> const programs = {&cached, &uncached};
+
+    std::cout << std::setw(10) << "size" << std::setw(14) << "cached" << std::setw(14) << "per-call"
+              << " (us per scan)" << std::endl;
+    for (size_t input_size: sizes) {
+        std::vector<float> input(input_size, 1.0f);
+        cl::Buffer dev_input(context, CL_MEM_READ_ONLY, sizeof(float) * input_size);
+        queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(float) * input_size, &input[0]);
+
+        std::cout << std::setw(10) << input_size;
+        for (ScanProgram const* program: programs) {
+            ScanPlan plan(*program, input_size);
+            plan.execute(dev_input);
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                plan.execute(dev_input);
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            double us = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+            std::cout << std::setw(14) << std::fixed << std::setprecision(1) << us;
+        }
+        std::cout << std::endl;
+    }
+}
 
-    cl::Buffer output(context, CL_MEM_READ_WRITE, sizeof(float) * input_size);
+// Three-phase float scans with the plain and the padded local layout, built
+// as two programs, and prints the average wall-clock time per scan.
+void benchmark_padding()
+{
+    size_t const sizes[] = {1 << 16, 1 << 20, 1 << 24};
+    int const iterations = 100;
+    bool const padding = selected_bank_padding;
+
+    struct Variant
+    {
+        char const* name;
+        scan_algorithm algorithm;
+        bool padded;
+    };
+    Variant const variants[] = {
+        {"hillis-steele", scan_algorithm::hillis_steele, false},
+        {"padded", scan_algorithm::hillis_steele, true},
+        {"blelloch", scan_algorithm::blelloch, false},
+        {"padded", scan_algorithm::blelloch, true}
+    };
+
+    std::cout << std::setw(10) << "size";
+    for (Variant const& variant: variants) {
+        std::cout << std::setw(14) << variant.name;
+    }
+    std::cout << " (us per scan)" << std::endl;
+
+    for (size_t input_size: sizes) {
+        std::vector<float> input(input_size, 1.0f);
+        cl::Buffer dev_input(context, CL_MEM_READ_ONLY, sizeof(float) * input_size);
+        queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(float) * input_size, &input[0]);
+
+        std::cout << std::setw(10) << input_size;
+        for (Variant const& variant: variants) {
+            selected_bank_padding = variant.padded;
+            ScanPlan plan(scan_program<cl_float, scan_add>(), input_size, scan_mode::three_phase, variant.algorithm);
+            plan.execute(dev_input);
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                plan.enqueue(dev_input);
+            }
+            queue.finish();
+            auto end = std::chrono::high_resolution_clock::now();
+            double us = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+            std::cout << std::setw(14) << std::fixed << std::setprecision(1) << us;
+        }
+        std::cout << std::endl;
+    }
+    selected_bank_padding = padding;
+}
 
-    size_t const global_size = (input_size / block_size + ((input_size % block_size)?1:0)) * block_size;
+// Int sums resident in host memory through the serial reference loop and
+// cpu_scan(), and resident on the device through a reused plan, and prints
+// the average wall-clock time per scan.
+void benchmark_cpu()
+{
+    size_t const sizes[] = {1024, 16384, 1 << 18, 1 << 20, 1 << 22};
+    int const iterations = 20;
+
+    std::cout << "cpu_scan threads: " << cpu_scan_pool().size()
+              << ", " << simd_isa_name(cpu_scan_isa()) << std::endl;
+    std::cout << std::setw(10) << "size" << std::setw(14) << "serial" << std::setw(14) << "cpu_scan"
+              << std::setw(14) << "device" << " (us per scan)" << std::endl;
+    for (size_t input_size: sizes) {
+        std::vector<cl_int> input(input_size, 1);
+        std::vector<cl_int> output(input_size);
+        cl::Buffer dev_input(context, CL_MEM_READ_ONLY, sizeof(cl_int) * input_size);
+        queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(cl_int) * input_size, &input[0]);
+        ScanPlan plan(scan_program<cl_int, scan_add>(), input_size);
+
+        std::function<void()> const scans[] = {
+            [&]{ output = cpu_inclusive_scan(input); },
+            [&]{ cpu_scan(&input[0], &output[0], input_size); },
+            [&]{ plan.execute(dev_input); }
+        };
+        std::cout << std::setw(10) << input_size;
+        for (std::function<void()> const& scan: scans) {
+            scan();
+            auto start = std::chrono::high_resolution_clock::now();
+            for (int i = 0; i < iterations; i++) {
+                scan();
+            }
+            auto end = std::chrono::high_resolution_clock::now();
+            double us = std::chrono::duration<double, std::micro>(end - start).count() / iterations;
+            std::cout << std::setw(14) << std::fixed << std::setprecision(1) << us;
+        }
+        std::cout << std::endl;
+    }
+}
 
-    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, cl::NDRange(global_size), cl::NDRange(block_size));
-    cl::Event event = kernel(enqueue_args, input, output, additions, input_size);
-    event.wait();
-    return output;
+// Float scans from 10^6 to 10^9 elements. Sizes whose input, output and
+// block totals fit on the device run through a plan per algorithm; every size
+// is also streamed from host memory, transfers included. Prints ms per scan.
+void benchmark_scaling()
+{
+    size_t const sizes[] = {1000000, 10000000, 100000000, 1000000000};
+    int const iterations = 3;
+    cl::Device const device = queue.getInfo<CL_QUEUE_DEVICE>();
+    cl_ulong const global_mem = device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>();
+    cl_ulong const max_alloc = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>();
+
+    struct Variant
+    {
+        char const* name;
+        scan_mode mode;
+        scan_algorithm algorithm;
+    };
+    Variant const variants[] = {
+        {"hillis-steele", scan_mode::three_phase, scan_algorithm::hillis_steele},
+        {"blelloch", scan_mode::three_phase, scan_algorithm::blelloch},
+        {"single-pass", scan_mode::single_pass, scan_algorithm::blelloch}
+    };
+
+    std::cout << std::setw(12) << "size";
+    for (Variant const& variant: variants) {
+        std::cout << std::setw(14) << variant.name;
+    }
+    std::cout << std::setw(14) << "streamed" << " (ms per scan)" << std::endl;
+
+    auto time_ms = [&](std::function<void()> const& scan) {
+        scan();
+        queue.finish();
+        auto start = std::chrono::high_resolution_clock::now();
+        for (int i = 0; i < iterations; i++) {
+            scan();
+        }
+        queue.finish();
+        auto end = std::chrono::high_resolution_clock::now();
+        return std::chrono::duration<double, std::milli>(end - start).count() / iterations;
+    };
+
+    for (size_t input_size: sizes) {
+        std::vector<float> input(input_size);
+        for (size_t i = 0; i < input_size; i++) {
+            input[i] = i % 10;
+        }
+        std::vector<float> output(input_size);
+        size_t const bytes = sizeof(float) * input_size;
+        bool const resident = bytes <= max_alloc && 3 * bytes <= global_mem;
+
+        std::cout << std::setw(12) << input_size << std::fixed << std::setprecision(1);
+        cl::Buffer dev_input;
+        if (resident) {
+            dev_input = cl::Buffer(context, CL_MEM_READ_ONLY, bytes);
+            queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, bytes, &input[0]);
+        }
+        for (Variant const& variant: variants) {
+            if (!resident) {
+                std::cout << std::setw(14) << "-";
+                continue;
+            }
+            try {
+                ScanPlan plan(scan_program<cl_float, scan_add>(), input_size, variant.mode, variant.algorithm);
+                std::cout << std::setw(14) << time_ms([&]{ plan.enqueue(dev_input); });
+            }
+            catch (cl::Error const & e) {
+                std::cout << std::setw(14) << "failed";
+            }
+        }
+        try {
+            StreamingScan streaming(scan_program<cl_float, scan_add>());
+            std::cout << std::setw(14) << time_ms([&]{ streaming.run(&input[0], &output[0], input_size); });
+        }
+        catch (cl::Error const & e) {
+            std::cout << std::setw(14) << "failed";
+        }
+        std::cout << std::endl;
+    }
 }
 
-cl::Buffer inclusive_scan(cl::Buffer input, size_t input_size)
+// Launches scans of count arrays of length floats, stride apart, once as a
+// single batched launch and once as one small_array_scan per array, and
+// prints the wall-clock time of both.
+void benchmark_batched()
 {
-    if (block_size >= input_size) {
-        return small_array_scan(input, input_size);
-    } else {
-        cl::Buffer subblocks;
-        cl::Buffer last_elements;
-        std::tie(subblocks, last_elements) = subblock_scan(input, input_size);
-        cl::Buffer last_elements_scaned = inclusive_scan(last_elements, input_size / block_size);
-        return merge(subblocks, last_elements_scaned, input_size);
+    size_t const count = 4096;
+    size_t const length = 200;
+    size_t const stride = 256;
+    ScanProgram const& program = scan_program<cl_float, scan_add>();
+
+    std::vector<float> input(count * stride, 1);
+    cl::Buffer dev_input(context, CL_MEM_READ_ONLY, sizeof(float) * input.size());
+    cl::Buffer dev_output(context, CL_MEM_READ_WRITE, sizeof(float) * input.size());
+    queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(float) * input.size(), &input[0]);
+
+    std::vector<cl::Buffer> inputs;
+    std::vector<cl::Buffer> outputs;
+    for (size_t k = 0; k < count; k++) {
+        cl_buffer_region region = {sizeof(float) * k * stride, sizeof(float) * length};
+        inputs.push_back(dev_input.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &region));
+        outputs.push_back(dev_output.createSubBuffer(CL_MEM_READ_WRITE, CL_BUFFER_CREATE_TYPE_REGION, &region));
+    }
+
+    std::vector<cl::Event> none;
+    auto start = std::chrono::high_resolution_clock::now();
+    batched_scan(program, dev_input, dev_output, count, stride, length, scan_kind::inclusive, none);
+    queue.finish();
+    auto middle = std::chrono::high_resolution_clock::now();
+    for (size_t k = 0; k < count; k++) {
+        small_array_scan(program, inputs[k], outputs[k], length, scan_algorithm::blelloch, false, none);
+    }
+    queue.finish();
+    auto end = std::chrono::high_resolution_clock::now();
+
+    std::cout << count << " arrays of " << length << ": batched "
+              << std::chrono::duration<double, std::milli>(middle - start).count() << " ms, one launch per array "
+              << std::chrono::duration<double, std::milli>(end - middle).count() << " ms" << std::endl;
+}
+
+template<typename T, typename Op>
+void check_scan(char const* name, std::vector<T> const& input)
+{
+    std::cout << name << ": ";
+    try {
+        cl::Buffer dev_output = inclusive_scan<T, Op>(upload(input), input.size());
+        cpu_check<T, Op>(input, read_buffer<T>(dev_output, input.size()));
+    }
+    catch (cl::Error const & e) {
+        std::cout << "not supported (" << e.what() << " #" << e.err() << ")" << std::endl;
+    }
+}
+
+// Checks every operator for element type T on inputs whose scans are exact:
+// small integers for add/max/min and +-1 for mul.
+template<typename T>
+void check_type(char const* type_name)
+{
+    size_t const input_size = 100000;
+    std::vector<T> const values = random_digits<T>(input_size);
+    std::vector<T> signs = random_digits<T>(input_size, 43);
+    for (T& x: signs) {
+        x = x < T(5) ? T(1) : T(-1);
+    }
+
+    std::string name(type_name);
+    check_scan<T, scan_add>((name + " add").c_str(), values);
+    check_scan<T, scan_mul>((name + " mul").c_str(), signs);
+    check_scan<T, scan_max>((name + " max").c_str(), values);
+    check_scan<T, scan_min>((name + " min").c_str(), values);
+}
+
+// Squares through the load transform and negation through the store
+// transform, fused into every scan mode, at one tile and at several levels.
+void check_fused()
+{
+    ScanTransform const transform = {"x * x", "-x"};
+
+    struct Variant
+    {
+        char const* name;
+        scan_mode mode;
+        scan_algorithm algorithm;
+        scan_kind kind;
+    };
+    Variant const variants[] = {
+        {"hillis-steele", scan_mode::three_phase, scan_algorithm::hillis_steele, scan_kind::inclusive},
+        {"blelloch", scan_mode::three_phase, scan_algorithm::blelloch, scan_kind::inclusive},
+        {"blelloch exclusive", scan_mode::three_phase, scan_algorithm::blelloch, scan_kind::exclusive},
+        {"single-pass", scan_mode::single_pass, scan_algorithm::blelloch, scan_kind::inclusive}
+    };
+
+    size_t const sizes[] = {100, 1000000};
+    for (size_t input_size: sizes) {
+        // from -5 to 4, negative values included
+        std::vector<cl_int> input = random_digits<cl_int>(input_size);
+        std::vector<cl_int> squares(input_size);
+        for (size_t i = 0; i < input_size; i++) {
+            input[i] -= 5;
+            squares[i] = input[i] * input[i];
+        }
+        cl::Buffer dev_input = upload(input);
+
+        for (Variant const& variant: variants) {
+            std::vector<cl_int> expected = variant.kind == scan_kind::exclusive
+                    ? cpu_exclusive_scan(squares, 0) : cpu_inclusive_scan(squares);
+            for (cl_int& x: expected) {
+                x = -x;
+            }
+            ScanPlan plan(scan_program<cl_int, scan_add>(transform), input_size,
+                          variant.mode, variant.algorithm, variant.kind);
+            std::cout << "fused " << variant.name << " " << input_size << ": ";
+            print_check(read_buffer<cl_int>(plan.execute(dev_input), input_size), expected);
+        }
+    }
+}
+
+// Exclusive and segmented int sums over several hierarchy levels, with
+// segments of random length from 1 to 100.
+void check_kinds()
+{
+    size_t const input_size = 1000000;
+    std::default_random_engine generator(42);
+    std::uniform_int_distribution<int> segment_start(0, 99);
+
+    std::vector<cl_int> const input = random_digits<cl_int>(input_size);
+    std::vector<cl_uint> heads(input_size);
+    for (size_t i = 0; i < input_size; i++) {
+        heads[i] = (i == 0 || segment_start(generator) == 0) ? 1 : 0;
     }
+    std::vector<cl_int> segmented_exclusive = cpu_segmented_scan(input, heads);
+    for (size_t i = input_size - 1; i > 0; i--) {
+        segmented_exclusive[i] = heads[i] ? 0 : segmented_exclusive[i - 1];
+    }
+    segmented_exclusive[0] = 0;
+
+    cl::Buffer dev_input = upload(input);
+    cl::Buffer dev_heads = upload(heads);
+
+    std::cout << "exclusive: ";
+    print_check(read_buffer<cl_int>(exclusive_scan<cl_int>(dev_input, input_size), input_size),
+                cpu_exclusive_scan(input, 0));
+    std::cout << "segmented inclusive: ";
+    print_check(read_buffer<cl_int>(segmented_scan<cl_int>(dev_input, dev_heads, input_size), input_size),
+                cpu_segmented_scan(input, heads));
+    std::cout << "segmented exclusive: ";
+    print_check(read_buffer<cl_int>(segmented_scan<cl_int>(dev_input, dev_heads, input_size, scan_kind::exclusive),
+                                    input_size),
+                segmented_exclusive);
 }
 
-int main()
+// Batched int sums over arrays of random length, some longer than a tile,
+// and over strided arrays of two fixed lengths.
+void check_batched()
+{
+    size_t const count = 1000;
+    std::default_random_engine generator(42);
+    std::uniform_int_distribution<size_t> lengths(0, 3000);
+
+    std::vector<cl_uint> offsets(1, 0);
+    size_t max_length = 0;
+    for (size_t k = 0; k < count; k++) {
+        size_t const length = lengths(generator);
+        max_length = std::max(max_length, length);
+        offsets.push_back(offsets.back() + length);
+    }
+    std::vector<cl_int> const input = random_digits<cl_int>(offsets.back());
+    std::vector<cl_int> expected;
+    for (size_t k = 0; k < count; k++) {
+        std::vector<cl_int> array(input.begin() + offsets[k], input.begin() + offsets[k + 1]);
+        std::vector<cl_int> scanned = cpu_inclusive_scan(array);
+        expected.insert(expected.end(), scanned.begin(), scanned.end());
+    }
+
+    cl::Buffer dev_input = upload(input, CL_MEM_READ_WRITE);
+    cl::Buffer dev_offsets = upload(offsets);
+    batched_scan<cl_int>(dev_input, dev_input, dev_offsets, count, max_length).wait();
+
+    std::cout << "batched: ";
+    print_check(read_buffer<cl_int>(dev_input, input.size()), expected);
+
+    // strided, in place, with gaps between the arrays left as they are;
+    // neither length is a multiple of the tile
+    for (size_t length: {size_t(1000), size_t(5000)}) {
+        size_t const stride = length + 3;
+        std::vector<cl_int> const strided = random_digits<cl_int>(count * stride);
+        std::vector<cl_int> strided_expected(strided);
+        for (size_t k = 0; k < count; k++) {
+            std::vector<cl_int> array(strided.begin() + k * stride, strided.begin() + k * stride + length);
+            std::vector<cl_int> scanned = cpu_inclusive_scan(array);
+            std::copy(scanned.begin(), scanned.end(), strided_expected.begin() + k * stride);
+        }
+
+        cl::Buffer dev_strided = upload(strided, CL_MEM_READ_WRITE);
+        batched_scan<cl_int>(dev_strided, dev_strided, count, stride, length).wait();
+        // nothing to scan
+        batched_scan<cl_int>(dev_strided, dev_strided, 0, stride, length).wait();
+
+        std::cout << "batched strided " << length << ": ";
+        print_check(read_buffer<cl_int>(dev_strided, strided.size()), strided_expected);
+    }
+}
+
+// Int sum streamed through the device in chunks far smaller than the input,
+// with a shorter last chunk.
+void check_streaming()
+{
+    size_t const input_size = 1000000;
+    size_t const chunk_size = 3 * tile_size(scan_program<cl_int, scan_add>(), scan_algorithm::blelloch) * 40;
+
+    std::vector<cl_int> const input = random_digits<cl_int>(input_size);
+    std::vector<cl_int> output;
+    streaming_scan<cl_int>(input, output, chunk_size);
+
+    std::cout << "streaming: ";
+    print_check(output, cpu_inclusive_scan(input));
+}
+
+// Int sum of a series scanned in full once, then grown by blocks of uneven
+// sizes through AppendScan.
+void check_append()
+{
+    size_t const initial_size = 100000;
+    std::vector<size_t> const blocks = {5000, 1, 30000, 5000, 2048};
+
+    size_t total = initial_size;
+    for (size_t block: blocks) {
+        total += block;
+    }
+    std::vector<cl_int> const input = random_digits<cl_int>(total);
+
+    cl::Buffer dev_input = upload(std::vector<cl_int>(input.begin(), input.begin() + initial_size));
+    cl::Buffer dev_series(context, CL_MEM_READ_WRITE, sizeof(cl_int) * total);
+    cl::Buffer prefix = inclusive_scan<cl_int>(dev_input, initial_size);
+    queue.enqueueCopyBuffer(prefix, dev_series, 0, 0, sizeof(cl_int) * initial_size);
+
+    AppendScan series(scan_program<cl_int, scan_add>());
+    series.resume(prefix, initial_size);
+    cl::Event appended;
+    for (size_t block: blocks) {
+        size_t const offset = series.size();
+        cl::Buffer dev_block = upload(std::vector<cl_int>(input.begin() + offset, input.begin() + offset + block));
+        appended = series.append(dev_block, block, dev_series, offset);
+    }
+    appended.wait();
+
+    std::cout << "append: ";
+    print_check(read_buffer<cl_int>(dev_series, total), cpu_inclusive_scan(input));
+}
+
+// Fenwick tree over int values: one batch of random point updates, some
+// hitting the same element, then a batch of random prefix queries, some
+// past the end.
+void check_fenwick()
+{
+    size_t const input_size = 100000;
+    size_t const count = 1000;
+    std::default_random_engine generator(42);
+    std::uniform_int_distribution<cl_uint> positions(0, input_size - 1);
+
+    std::vector<cl_int> const input = random_digits<cl_int>(input_size);
+    std::vector<cl_int> deltas = random_digits<cl_int>(count, 43);
+    std::vector<cl_uint> update_indices(count);
+    std::vector<cl_uint> query_indices(count);
+    for (size_t k = 0; k < count; k++) {
+        update_indices[k] = positions(generator) % 100;
+        deltas[k] -= 5;
+        query_indices[k] = positions(generator);
+    }
+    query_indices[0] = input_size;
+    query_indices[1] = 0xffffffff;
+
+    std::vector<cl_int> updated(input);
+    for (size_t k = 0; k < count; k++) {
+        updated[update_indices[k]] += deltas[k];
+    }
+    std::vector<cl_int> prefix = cpu_inclusive_scan(updated);
+    std::vector<cl_int> expected(count);
+    for (size_t k = 0; k < count; k++) {
+        expected[k] = prefix[std::min<size_t>(query_indices[k], input_size - 1)];
+    }
+
+    cl::Buffer dev_results(context, CL_MEM_WRITE_ONLY, sizeof(cl_int) * count);
+    FenwickTree tree = fenwick_tree<cl_int>(upload(input), input_size);
+    std::vector<cl::Event> updated_events(1, tree.update(upload(update_indices), upload(deltas), count));
+    tree.query(upload(query_indices), dev_results, count, updated_events).wait();
+
+    std::cout << "fenwick: ";
+    print_check(read_buffer<cl_int>(dev_results, count), expected);
+}
+
+// Fenwick tree over float sixteenths, deep enough that the prefixes lose
+// them: every node up to 1 << 16 elements wide still sums exactly.
+void check_fenwick_float()
+{
+    size_t const input_size = 1 << 22;
+    size_t const widest = 1 << 16;
+
+    // from 0 to 9 sixteenths
+    std::vector<cl_float> input = random_digits<cl_float>(input_size);
+    for (cl_float& x: input) {
+        x /= 16;
+    }
+    FenwickTree tree = fenwick_tree<cl_float>(upload(input), input_size);
+    std::vector<cl_float> nodes = read_buffer<cl_float>(tree.tree(), input_size);
+
+    std::vector<cl_float> output;
+    std::vector<cl_float> expected;
+    for (size_t i = 1; i <= input_size; i++) {
+        size_t const width = i & (~i + 1);
+        if (width > widest) {
+            continue;
+        }
+        double sum = 0;
+        for (size_t j = i - width; j < i; j++) {
+            sum += input[j];
+        }
+        output.push_back(nodes[i - 1]);
+        expected.push_back(cl_float(sum));
+    }
+    std::cout << "fenwick float: ";
+    print_check(output, expected);
+}
+
+// Int sum split across every device of the context.
+void check_multi_device(std::vector<cl::Device> const& devices)
+{
+    size_t const input_size = 1000000;
+
+    std::vector<cl_int> const input = random_digits<cl_int>(input_size);
+    cl::Buffer dev_input = upload(input);
+    cl::Buffer dev_output(context, CL_MEM_READ_WRITE, sizeof(cl_int) * input_size);
+
+    MultiDeviceScan scan(scan_program<cl_int, scan_add>(), input_size, devices);
+    scan.execute(dev_input, dev_output);
+
+    std::cout << "multi-device (" << scan.partitions() << " partitions): ";
+    print_check(read_buffer<cl_int>(dev_output, input_size), cpu_inclusive_scan(input));
+}
+
+// Int sums and maxima through cpu_scan(), at sizes around its SIMD width and
+// its per-thread chunk, with every instruction set the CPU supports.
+void check_cpu()
+{
+    simd_isa const best = cpu_simd_isa();
+    size_t const sizes[] = {1, 7, 9, 1000, 3 * cpu_scan_grain + 5, 1 << 22};
+    for (simd_isa isa: {simd_isa::scalar, simd_isa::sse2, simd_isa::avx2}) {
+        if (isa > best) {
+            break;
+        }
+        set_cpu_scan_isa(isa);
+        for (size_t input_size: sizes) {
+            std::vector<cl_int> const input = random_digits<cl_int>(input_size);
+            std::cout << "cpu_scan " << simd_isa_name(isa) << " " << input_size << " add: ";
+            print_check(cpu_scan(input), cpu_inclusive_scan(input));
+            std::cout << "cpu_scan " << simd_isa_name(isa) << " " << input_size << " max: ";
+            print_check(cpu_scan<cl_int, scan_max>(input), cpu_inclusive_scan<cl_int, scan_max>(input));
+        }
+    }
+    set_cpu_scan_isa(best);
+}
+
+// Int sums of several sizes through the calibrated dispatcher, which takes
+// the host path for the small ones.
+void check_dispatch()
+{
+    ScanDispatcher dispatcher;
+
+    for (size_t input_size: {1, 100, 10000, 1000000}) {
+        std::vector<cl_int> const input = random_digits<cl_int>(input_size);
+        std::cout << "dispatch " << input_size
+                  << (input_size < dispatcher.crossover() ? " (host): " : " (device): ");
+        print_check(dispatcher.inclusive_scan<cl_int>(input), cpu_inclusive_scan(input));
+    }
+}
+
+void check_types()
+{
+    check_type<cl_float>("float");
+    check_type<cl_double>("double");
+    check_type<cl_int>("int32");
+    check_type<cl_uint>("uint32");
+    check_type<cl_long>("int64");
+}
+
+// Scans input.txt into output.txt with cpu_scan() when no OpenCL device can
+// be set up.
+void host_fallback()
+{
+    size_t input_size;
+    std::ifstream input_file("input.txt");
+    input_file >> input_size;
+
+    std::vector<float> input(input_size);
+    for (size_t i = 0; i < input_size; i++) {
+        input_file >> input[i];
+    }
+
+    std::vector<float> output = cpu_scan(input);
+    cpu_check(input, output);
+
+    std::ofstream output_file("output.txt");
+    for (size_t i = 0; i < input_size; i++) {
+        output_file << output[i] << " ";
+    }
+}
+
+int main(int argc, char* argv[])
 {
     try {
         std::vector<cl::Device> devices;
@@ -174,6 +860,11 @@ int main()
         // select device
         platform.getDevices(CL_DEVICE_TYPE_ALL, &devices);
         cl::Device device = selectDevice(devices);
+        selected_scan_mode = select_scan_mode(device);
+        selected_scan_features = detect_scan_features(device);
+        std::cout << "built-in scans: "
+                  << (selected_scan_features.work_group_scan ? "work-group"
+                      : selected_scan_features.sub_group_scan ? "sub-group" : "none") << std::endl;
 
         // create context
         context = cl::Context(devices);
@@ -187,16 +878,43 @@ int main()
         std::string cl_string{std::istreambuf_iterator<char>(cl_file),
                     std::istreambuf_iterator<char>()};
 
-        cl::Program::Sources source(1,
-                                    std::make_pair(cl_string.c_str(),
-                                                   cl_string.length() + 1));
-
-        // create programm
-        program = cl::Program(context, source);
+        init_scan_programs(cl_string, devices);
+        for (int i = 1; i < argc; i++) {
+            if (std::string(argv[i]) == "--bank-padding") {
+                selected_bank_padding = true;
+            }
+        }
 
         // compile opencl source
         try {
-            program.build(devices);
+            scan_program<cl_float, scan_add>();
+
+            if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+                benchmark();
+                benchmark_batched();
+                benchmark_launch();
+                benchmark_padding();
+                benchmark_cpu();
+                return 0;
+            }
+            if (argc > 1 && std::string(argv[1]) == "--benchmark-scaling") {
+                benchmark_scaling();
+                return 0;
+            }
+            if (argc > 1 && std::string(argv[1]) == "--check") {
+                check_types();
+                check_kinds();
+                check_fused();
+                check_batched();
+                check_streaming();
+                check_append();
+                check_fenwick();
+                check_fenwick_float();
+                check_multi_device(devices);
+                check_cpu();
+                check_dispatch();
+                return 0;
+            }
 
             size_t input_size;
             std::ifstream input_file("input.txt");
@@ -214,13 +932,22 @@ int main()
 
             std::vector<float> output(input_size, 0);
 
-            cl::Buffer dev_input (context, CL_MEM_READ_ONLY, sizeof(float) * input_size);
-            queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(float) * input_size, &input[0]);
-
-            cl::Buffer dev_output = inclusive_scan(dev_input, input_size);
-
-            queue.enqueueReadBuffer(dev_output, CL_TRUE, 0, sizeof(float) * input_size, &output[0]);
-            queue.finish();
+            if (input_size > default_chunk_size(device, scan_program<cl_float, scan_add>())) {
+                // too large to keep on the device at once
+                streaming_scan<cl_float>(input, output);
+            } else if (input_size < ScanDispatcher().crossover()) {
+                // a round trip to the device would take longer
+                output = ScanDispatcher::host_scan<cl_float>(input);
+            } else {
+                cl::Buffer dev_input (context, CL_MEM_READ_ONLY, sizeof(float) * input_size);
+                queue.enqueueWriteBuffer(dev_input, CL_TRUE, 0, sizeof(float) * input_size, &input[0]);
+
+                cl::Buffer dev_output;
+                std::vector<cl::Event> scanned(1, inclusive_scan_async(dev_input, input_size, dev_output));
+
+                queue.enqueueReadBuffer(dev_output, CL_TRUE, 0, sizeof(float) * input_size, &output[0], &scanned);
+                queue.finish();
+            }
 
             cpu_check(input, output);
 
@@ -231,9 +958,7 @@ int main()
 
         }
         catch (cl::Error const & e) {
-            std::string log_str = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
             std::cout << std::endl << e.what() << " : " << e.err() << std::endl;
-            std::cout << log_str;
             return 0;
         }
 
@@ -241,6 +966,8 @@ int main()
     }
     catch (cl::Error const & e) {
         std::cout << "Error: " << e.what() << " #" << e.err() << std::endl;
+        std::cout << "falling back to the host scan" << std::endl;
+        host_fallback();
     }
 
     return 0;
@@ -0,0 +1,121 @@
+#include "multi_device_scan.h"
+
+#include <algorithm>
+
+MultiDeviceScan::MultiDeviceScan(ScanProgram const& program, size_t input_size,
+                                 std::vector<cl::Device> const& devices)
+    : program_(program)
+    , input_size_(input_size)
+{
+    // Partitions are read and written through sub-buffers, whose origins must
+    // meet every device's alignment; starting them on tile boundaries keeps
+    // the partial tile in the last partition. Both are powers of two.
+    size_t granularity = tile_size(program_, scan_algorithm::blelloch);
+    cl_ulong total_units = 0;
+    for (cl::Device const& device: devices) {
+        size_t const align = device.getInfo<CL_DEVICE_MEM_BASE_ADDR_ALIGN>() / 8;
+        granularity = std::max(granularity, align / program_.element_size);
+        total_units += device.getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>();
+    }
+
+    size_t offset = 0;
+    for (size_t k = 0; k < devices.size() && offset < input_size_; k++) {
+        size_t size = input_size_ - offset;
+        if (k + 1 < devices.size()) {
+            cl_ulong const share = input_size_ * devices[k].getInfo<CL_DEVICE_MAX_COMPUTE_UNITS>() / total_units;
+            size = std::min<size_t>(size, std::max<size_t>(granularity, share / granularity * granularity));
+        }
+
+        cl::CommandQueue device_queue(context, devices[k]);
+        Partition partition = {
+            offset,
+            size,
+            device_queue,
+            ScanPlan(program_, size, select_scan_mode(devices[k]), scan_algorithm::blelloch,
+                     scan_kind::inclusive, device_queue),
+            cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size),
+            cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size),
+            cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size),
+            cl::Buffer(),
+            cl::Buffer()
+        };
+        partitions_.push_back(partition);
+        offset += size;
+    }
+
+    totals_ = cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size * partitions_.size());
+    offsets_ = cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size * partitions_.size());
+}
+
+void MultiDeviceScan::bind(cl::Buffer input, cl::Buffer output)
+{
+    if (input() == input_() && output() == output_()) {
+        return;
+    }
+    size_t const element_size = program_.element_size;
+    for (Partition& partition: partitions_) {
+        cl_buffer_region region = {element_size * partition.offset, element_size * partition.size};
+        partition.input = input.createSubBuffer(CL_MEM_READ_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &region);
+        partition.output = output.createSubBuffer(CL_MEM_WRITE_ONLY, CL_BUFFER_CREATE_TYPE_REGION, &region);
+    }
+    // holding the parents keeps their handles from being reused
+    input_ = input;
+    output_ = output;
+}
+
+cl::Event MultiDeviceScan::enqueue(cl::Buffer input, cl::Buffer output, std::vector<cl::Event> const& wait_list)
+{
+    size_t const element_size = program_.element_size;
+    bind(input, output);
+
+    std::vector<cl::Event> scanned;
+    std::vector<cl::Event> totals_ready;
+    for (size_t k = 0; k < partitions_.size(); k++) {
+        Partition& partition = partitions_[k];
+        scanned.push_back(partition.plan.enqueue(partition.input, wait_list));
+        std::vector<cl::Event> after_scan(1, scanned.back());
+        cl::Event total;
+        partition.queue.enqueueCopyBuffer(partition.plan.output(), partition.total, element_size * (partition.size - 1),
+                                          0, element_size, &after_scan, &total);
+        totals_ready.push_back(total);
+        // other queues wait on these commands
+        partition.queue.flush();
+    }
+
+    // totals_ is only ever written from one queue
+    cl::CommandQueue first_queue = partitions_.front().queue;
+    std::vector<cl::Event> gathered(partitions_.size());
+    for (size_t k = 0; k < partitions_.size(); k++) {
+        std::vector<cl::Event> after_total(1, totals_ready[k]);
+        first_queue.enqueueCopyBuffer(partitions_[k].total, totals_, 0, element_size * k, element_size,
+                                      &after_total, &gathered[k]);
+    }
+    std::vector<cl::Event> offsets_ready(1, small_array_scan(program_, totals_, offsets_, partitions_.size(),
+                                                             scan_algorithm::blelloch, true, gathered,
+                                                             first_queue));
+    first_queue.flush();
+
+    std::vector<cl::Event> written;
+    for (size_t k = 0; k < partitions_.size(); k++) {
+        Partition& partition = partitions_[k];
+        std::vector<cl::Event> carry_wait_list(1, scanned[k]);
+        cl::Event carried;
+        partition.queue.enqueueCopyBuffer(offsets_, partition.carry, element_size * k, 0, element_size,
+                                          &offsets_ready, &carried);
+        carry_wait_list.push_back(carried);
+        written.push_back(apply_carry(program_, partition.plan.output(), partition.output, partition.carry,
+                                      partition.scratch, partition.size, 0, k == 0, carry_wait_list,
+                                      partition.queue));
+        partition.queue.flush();
+    }
+
+    cl::Event done;
+    first_queue.enqueueMarkerWithWaitList(&written, &done);
+    first_queue.flush();
+    return done;
+}
+
+void MultiDeviceScan::execute(cl::Buffer input, cl::Buffer output)
+{
+    enqueue(input, output).wait();
+}
@@ -0,0 +1,54 @@
+#ifndef MULTI_DEVICE_SCAN_H
+#define MULTI_DEVICE_SCAN_H
+
+#include "scan.h"
+
+// Inclusive scan of a fixed number of elements split across several devices
+// of the shared context. Every device scans its own partition on its own
+// queue, the partition totals are scanned on the first device, and then all
+// devices add their partition's offset in parallel. Partition sizes follow
+// the devices' compute unit counts.
+class MultiDeviceScan
+{
+public:
+    MultiDeviceScan(ScanProgram const& program, size_t input_size, std::vector<cl::Device> const& devices);
+
+    // Scans input into output, both buffers of input_size elements in the
+    // shared context. The returned event completes when output is written.
+    cl::Event enqueue(cl::Buffer input, cl::Buffer output,
+                      std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+    // Blocking enqueue().
+    void execute(cl::Buffer input, cl::Buffer output);
+
+    // Devices that got a non-empty partition.
+    size_t partitions() const { return partitions_.size(); }
+
+private:
+    struct Partition
+    {
+        size_t offset;
+        size_t size;
+        cl::CommandQueue queue;
+        ScanPlan plan;
+        cl::Buffer total;   // the partition's last element, written on its queue
+        cl::Buffer carry;   // the partition's offset, read by apply_carry
+        cl::Buffer scratch; // apply_carry's unused carry_out
+        cl::Buffer input;   // sub-buffers of the bound input and output
+        cl::Buffer output;
+    };
+
+    // Makes the partitions' sub-buffers of input and output unless they are
+    // the ones bound already.
+    void bind(cl::Buffer input, cl::Buffer output);
+
+    ScanProgram program_;
+    size_t input_size_;
+    std::vector<Partition> partitions_;
+    cl::Buffer input_;
+    cl::Buffer output_;
+    cl::Buffer totals_;  // gathered on the first queue only
+    cl::Buffer offsets_;
+};
+
+#endif // MULTI_DEVICE_SCAN_H
@@ -0,0 +1,645 @@
+#include "scan.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <stdexcept>
+
+cl::Context context;
+cl::CommandQueue queue;
+
+static std::string scan_source;
+static std::vector<cl::Device> scan_devices;
+static std::map<std::string, ScanProgram> scan_programs;
+
+void init_scan_programs(std::string const& source, std::vector<cl::Device> const& devices)
+{
+    scan_source = source;
+    scan_devices = devices;
+    scan_programs.clear();
+}
+
+scan_mode selected_scan_mode = scan_mode::three_phase;
+
+// Decoupled look-back spins on flags published by other work-groups, which is
+// only safe if running work-groups keep making progress. GPUs and CPU runtimes
+// provide that in practice; accelerators and custom devices get the fallback.
+scan_mode select_scan_mode(cl::Device const& device)
+{
+    cl_device_type type = device.getInfo<CL_DEVICE_TYPE>();
+    if (type & (CL_DEVICE_TYPE_GPU | CL_DEVICE_TYPE_CPU)) {
+        return scan_mode::single_pass;
+    }
+    return scan_mode::three_phase;
+}
+
+ScanFeatures selected_scan_features = {false, false, false};
+
+// OpenCL 3.0 value, absent from 1.2 headers
+#ifndef CL_DEVICE_WORK_GROUP_COLLECTIVE_FUNCTIONS_SUPPORT
+#define CL_DEVICE_WORK_GROUP_COLLECTIVE_FUNCTIONS_SUPPORT 0x1911
+#endif
+
+ScanFeatures detect_scan_features(cl::Device const& device)
+{
+    ScanFeatures features = {false, false, false};
+
+    // "OpenCL <major>.<minor> ..." and "OpenCL C <major>.<minor> ..."
+    int major = 0;
+    int minor = 0;
+    std::string const version = device.getInfo<CL_DEVICE_VERSION>();
+    std::sscanf(version.c_str(), "OpenCL %d.%d", &major, &minor);
+    if (major >= 3) {
+        // the collectives are an optional 3.0 feature
+        cl_bool supported = CL_FALSE;
+        device.getInfo(CL_DEVICE_WORK_GROUP_COLLECTIVE_FUNCTIONS_SUPPORT, &supported);
+        features.work_group_scan = supported == CL_TRUE;
+        features.opencl_c_3 = true;
+    } else {
+        int c_major = 0;
+        int c_minor = 0;
+        std::string const c_version = device.getInfo<CL_DEVICE_OPENCL_C_VERSION>();
+        std::sscanf(c_version.c_str(), "OpenCL C %d.%d", &c_major, &c_minor);
+        features.work_group_scan = c_major >= 2;
+    }
+
+    std::string const extensions = device.getInfo<CL_DEVICE_EXTENSIONS>();
+    features.sub_group_scan = extensions.find("cl_khr_subgroups") != std::string::npos
+            || extensions.find("cl_intel_subgroups") != std::string::npos;
+    return features;
+}
+
+size_t next_power_of_two(size_t x)
+{
+    size_t p = 1;
+    while (p < x) p <<= 1;
+    return p;
+}
+
+bool selected_bank_padding = false;
+
+static std::string build_options_with(ScanFeatures const& features)
+{
+    std::string options = "-DITEMS_PER_THREAD=" + std::to_string(items_per_thread);
+    if (selected_bank_padding) {
+        options += " -DSCAN_PAD_BANKS -DLOG_NUM_BANKS=" + std::to_string(log_num_banks);
+    }
+    if (features.work_group_scan) {
+        options += features.opencl_c_3 ? " -cl-std=CL3.0" : " -cl-std=CL2.0";
+        options += " -DSCAN_WORK_GROUP_SCAN";
+    } else if (features.sub_group_scan) {
+        options += " -DSCAN_SUB_GROUP_SCAN";
+    }
+    return options;
+}
+
+std::string scan_build_options()
+{
+    return build_options_with(selected_scan_features);
+}
+
+// Work-groups beyond this only lengthen the serial phases of the block scans.
+static size_t const max_block_size = 1024;
+
+static size_t gcd(size_t a, size_t b)
+{
+    while (b != 0) {
+        size_t const r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Largest power of two that every target device and every kernel of program
+// accepts as work-group size, leaving local memory for the biggest
+// per-work-item footprint plus padding: two elements for Hillis-Steele, an
+// element and a head flag for the segmented scans. The tree kernels need a
+// power of two, which is a multiple of the kernels' preferred work-group
+// size multiples only if those are no larger powers of two;
+// CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE does not promise that, so a
+// size that is not a multiple of them is reported.
+static size_t select_block_size(std::vector<cl::Kernel> const& kernels, size_t element_size, bool padded_local)
+{
+    size_t const local_per_item = 2 * std::max(element_size, sizeof(cl_uint));
+    size_t const banks = size_t(1) << log_num_banks;
+    size_t limit = max_block_size;
+    size_t preferred = 1;
+    for (cl::Device const& device: scan_devices) {
+        limit = std::min(limit, device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>());
+        limit = std::min(limit, device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>()[0]);
+        cl_ulong const local_mem = device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+        for (cl::Kernel const& kernel: kernels) {
+            limit = std::min(limit, kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device));
+            // statically sized __local variables, e.g. the batched carry
+            cl_ulong const fixed = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device);
+            cl_ulong available = local_mem - std::min(fixed, local_mem);
+            if (padded_local) {
+                // n entries take n + n / banks slots
+                available = available * banks / (banks + 1);
+            }
+            limit = std::min<size_t>(limit, available / local_per_item);
+            size_t const multiple = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+            // least common multiple of them all
+            preferred = preferred / gcd(preferred, multiple) * multiple;
+        }
+    }
+
+    size_t result = 1;
+    while (result * 2 <= limit) result *= 2;
+    if (result % preferred != 0) {
+        std::cout << "scan work-group size " << result << " is not a multiple of the preferred "
+                  << preferred << std::endl;
+    }
+    return result;
+}
+
+// Scan source behind head built for every target device. A failed build
+// prints the build log and rethrows.
+static cl::Program build_scan_source(std::string const& head, std::string const& build_options)
+{
+    cl::Program::Sources source;
+    if (!head.empty()) {
+        source.push_back(std::make_pair(head.c_str(), head.length()));
+    }
+    source.push_back(std::make_pair(scan_source.c_str(), scan_source.length() + 1));
+    cl::Program program(context, source);
+    try {
+        program.build(scan_devices, build_options.c_str());
+    }
+    catch (cl::Error const & e) {
+        for (cl::Device const& device: scan_devices) {
+            std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+        }
+        throw;
+    }
+    return program;
+}
+
+ScanProgram const& scan_program(std::string const& options, size_t element_size, std::string const& prelude)
+{
+    // a fused program is built with the options its plain one actually got
+    ScanProgram const* plain = nullptr;
+    std::string head;
+    std::string build_options = scan_build_options() + options;
+    if (!prelude.empty()) {
+        plain = &scan_program(options, element_size);
+        build_options = plain->build_options;
+        // keeps build log line numbers those of the kernel file
+        head = prelude + "#line 1\n";
+    }
+
+    std::string const key = build_options + prelude;
+    auto cached = scan_programs.find(key);
+    if (cached != scan_programs.end()) {
+        return cached->second;
+    }
+
+    cl::Program program;
+    try {
+        program = build_scan_source(head, build_options);
+    }
+    catch (cl::Error const & e) {
+        // the plain program built with the same options, so a failure with
+        // a prelude is the transform's own
+        if (!prelude.empty()
+                || (!selected_scan_features.work_group_scan && !selected_scan_features.sub_group_scan)) {
+            throw;
+        }
+        // only this program does without them, e.g. one of a type the
+        // device lacks; it stays cached under the options asked for
+        std::cout << "retrying without built-in scans" << std::endl;
+        build_options = build_options_with(ScanFeatures{false, false, false}) + options;
+        program = build_scan_source(head, build_options);
+    }
+
+    std::vector<cl::Kernel> kernels;
+    program.createKernels(&kernels);
+
+    ScanProgram& result = scan_programs[key];
+    result.program = program;
+    result.build_options = build_options;
+    result.element_size = element_size;
+    result.padded_local = selected_bank_padding;
+    result.block_size = select_block_size(kernels, element_size, result.padded_local);
+    result.plain = plain;
+    for (cl::Kernel const& kernel: kernels) {
+        result.kernels[kernel.getInfo<CL_KERNEL_FUNCTION_NAME>()] = kernel;
+    }
+    return result;
+}
+
+cl::Kernel ScanProgram::kernel(std::string const& name) const
+{
+    auto cached = kernels.find(name);
+    if (cached != kernels.end()) {
+        return cached->second;
+    }
+    return cl::Kernel(program, name.c_str());
+}
+
+size_t tile_size(ScanProgram const& program, scan_algorithm algorithm)
+{
+    return algorithm == scan_algorithm::blelloch ? program.block_size * items_per_thread : program.block_size;
+}
+
+// Entries to allocate for a local scan array of n entries, including the
+// pad entries of the bank-conflict-free layout.
+static size_t local_entries(ScanProgram const& program, size_t n)
+{
+    return program.padded_local ? n + (n >> log_num_banks) : n;
+}
+
+static size_t blocks_count(size_t input_size, size_t tile)
+{
+    return input_size / tile + ((input_size % tile)?1:0);
+}
+
+static void check_exclusive(scan_algorithm algorithm, bool exclusive)
+{
+    if (exclusive && algorithm != scan_algorithm::blelloch) {
+        throw std::invalid_argument("exclusive scan needs the blelloch algorithm");
+    }
+}
+
+cl::Event small_array_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output, size_t input_size,
+                           scan_algorithm algorithm, bool exclusive, std::vector<cl::Event> const& wait_list,
+                           cl::CommandQueue command_queue)
+{
+    if (input_size > tile_size(program, algorithm)) throw std::invalid_argument("input too big");
+    check_exclusive(algorithm, exclusive);
+
+    if (algorithm == scan_algorithm::blelloch) {
+        auto kernel = cl::make_kernel< cl::Buffer&
+                , cl::Buffer&
+                , cl::LocalSpaceArg
+                , unsigned int
+                , unsigned int >(program.kernel("small_array_scan_blelloch"));
+        size_t const local_size = blocks_count(input_size, items_per_thread);
+        auto enqueue_args = cl::EnqueueArgs(command_queue, wait_list, cl::NDRange(local_size), cl::NDRange(local_size));
+        return kernel(enqueue_args, input, output, cl::Local(program.element_size * local_entries(program, next_power_of_two(local_size))),
+                      input_size, exclusive);
+    } else {
+        auto enqueue_args = cl::EnqueueArgs(command_queue, wait_list, cl::NDRange(input_size), cl::NDRange(input_size));
+        auto kernel = cl::make_kernel< cl::Buffer&
+                , cl::Buffer&
+                , cl::LocalSpaceArg
+                , cl::LocalSpaceArg >(program.kernel("small_array_scan"));
+        return kernel(enqueue_args, input, output,
+                      cl::Local(program.element_size * local_entries(program, input_size)),
+                      cl::Local(program.element_size * local_entries(program, input_size)));
+    }
+}
+
+cl::Event subblock_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output, cl::Buffer last_elements,
+                        size_t input_size, scan_algorithm algorithm, bool exclusive,
+                        std::vector<cl::Event> const& wait_list,
+                        cl::CommandQueue command_queue)
+{
+    check_exclusive(algorithm, exclusive);
+    size_t const global_size = blocks_count(input_size, tile_size(program, algorithm)) * program.block_size;
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(command_queue, wait_list, cl::NDRange(global_size), cl::NDRange(program.block_size));
+    if (algorithm == scan_algorithm::blelloch) {
+        auto kernel = cl::make_kernel< cl::Buffer&
+                , cl::Buffer&
+                , cl::Buffer&
+                , cl::LocalSpaceArg
+                , unsigned int
+                , unsigned int >(program.kernel("subblock_scan_blelloch"));
+        return kernel(enqueue_args, input, output, last_elements,
+                      cl::Local(program.element_size * local_entries(program, next_power_of_two(program.block_size))), input_size, exclusive);
+    } else {
+        auto kernel = cl::make_kernel< cl::Buffer&
+                , cl::Buffer&
+                , cl::Buffer&
+                , cl::LocalSpaceArg
+                , cl::LocalSpaceArg
+                , unsigned int >(program.kernel("subblock_scan"));
+        return kernel(enqueue_args, input, output, last_elements,
+                      cl::Local(program.element_size * local_entries(program, program.block_size)),
+                      cl::Local(program.element_size * local_entries(program, program.block_size)), input_size);
+    }
+}
+
+cl::Event merge(ScanProgram const& program, cl::Buffer input, cl::Buffer output, cl::Buffer additions,
+                size_t input_size, size_t tile, std::vector<cl::Event> const& wait_list,
+                cl::CommandQueue command_queue)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , unsigned int
+            , unsigned int >(program.kernel("merge"));
+
+    size_t const global_size = blocks_count(input_size, program.block_size) * program.block_size;
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(command_queue, wait_list, cl::NDRange(global_size), cl::NDRange(program.block_size));
+    return kernel(enqueue_args, input, output, additions, input_size, tile);
+}
+
+cl::Event single_pass_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                           cl::Buffer flags, cl::Buffer aggregates, cl::Buffer prefixes,
+                           size_t input_size, bool exclusive, std::vector<cl::Event> const& wait_list,
+                           cl::CommandQueue command_queue)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::LocalSpaceArg
+            , unsigned int
+            , unsigned int >(program.kernel("single_pass_scan"));
+    size_t const tiles = blocks_count(input_size, tile_size(program, scan_algorithm::blelloch));
+    size_t const global_size = tiles * program.block_size;
+
+    // one status flag per tile plus the tile counter
+    std::vector<cl::Event> cleared(1);
+    command_queue.enqueueFillBuffer<cl_uint>(flags, 0, 0, sizeof(cl_uint) * (tiles + 1), &wait_list, &cleared[0]);
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(command_queue, cleared, cl::NDRange(global_size), cl::NDRange(program.block_size));
+    return kernel(enqueue_args, input, output, flags, aggregates, prefixes,
+                  cl::Local(program.element_size * local_entries(program, next_power_of_two(program.block_size))), input_size, exclusive);
+}
+
+cl::Event small_array_segmented_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer heads,
+                                     cl::Buffer output, size_t input_size, bool exclusive,
+                                     std::vector<cl::Event> const& wait_list)
+{
+    if (input_size > tile_size(program, scan_algorithm::blelloch)) throw std::invalid_argument("input too big");
+
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::LocalSpaceArg
+            , cl::LocalSpaceArg
+            , unsigned int
+            , unsigned int >(program.kernel("small_array_segmented_scan"));
+    size_t const local_size = blocks_count(input_size, items_per_thread);
+    size_t const local_count = next_power_of_two(local_size);
+    auto enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(local_size), cl::NDRange(local_size));
+    return kernel(enqueue_args, input, heads, output,
+                  cl::Local(sizeof(cl_uint) * local_entries(program, local_count)),
+                  cl::Local(program.element_size * local_entries(program, local_count)),
+                  input_size, exclusive);
+}
+
+cl::Event subblock_segmented_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer heads,
+                                  cl::Buffer output, cl::Buffer seen,
+                                  cl::Buffer last_elements, cl::Buffer last_heads,
+                                  size_t input_size, bool exclusive,
+                                  std::vector<cl::Event> const& wait_list)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::LocalSpaceArg
+            , cl::LocalSpaceArg
+            , unsigned int
+            , unsigned int >(program.kernel("subblock_segmented_scan"));
+    size_t const global_size = blocks_count(input_size, tile_size(program, scan_algorithm::blelloch)) * program.block_size;
+    size_t const local_count = next_power_of_two(program.block_size);
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(global_size), cl::NDRange(program.block_size));
+    return kernel(enqueue_args, input, heads, output, seen, last_elements, last_heads,
+                  cl::Local(sizeof(cl_uint) * local_entries(program, local_count)),
+                  cl::Local(program.element_size * local_entries(program, local_count)),
+                  input_size, exclusive);
+}
+
+cl::Event segmented_merge(ScanProgram const& program, cl::Buffer input, cl::Buffer output, cl::Buffer seen,
+                          cl::Buffer additions, size_t input_size, std::vector<cl::Event> const& wait_list)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , unsigned int
+            , unsigned int >(program.kernel("segmented_merge"));
+
+    size_t const global_size = blocks_count(input_size, program.block_size) * program.block_size;
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(global_size), cl::NDRange(program.block_size));
+    return kernel(enqueue_args, input, output, seen, additions, input_size, tile_size(program, scan_algorithm::blelloch));
+}
+
+// Event completing with wait_list, for launches with nothing to do; an
+// empty NDRange is an error.
+static cl::Event enqueue_marker(std::vector<cl::Event> const& wait_list)
+{
+    cl::Event done;
+    queue.enqueueMarkerWithWaitList(&wait_list, &done);
+    return done;
+}
+
+// Work-group size for arrays of at most max_length elements: no wider than
+// needed to cover them in one tile.
+static size_t batch_group_size(ScanProgram const& program, size_t max_length)
+{
+    size_t const items = std::max<size_t>(blocks_count(max_length, items_per_thread), 1);
+    return std::min(program.block_size, next_power_of_two(items));
+}
+
+cl::Event batched_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                       size_t count, size_t stride, size_t length, scan_kind kind,
+                       std::vector<cl::Event> const& wait_list)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::LocalSpaceArg
+            , unsigned int
+            , unsigned int
+            , unsigned int >(program.kernel("batched_scan_strided"));
+    if (count == 0) {
+        return enqueue_marker(wait_list);
+    }
+    size_t const group_size = batch_group_size(program, length);
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(count * group_size), cl::NDRange(group_size));
+    return kernel(enqueue_args, input, output, cl::Local(program.element_size * local_entries(program, next_power_of_two(group_size))),
+                  stride, length, kind == scan_kind::exclusive);
+}
+
+cl::Event batched_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                       cl::Buffer offsets, size_t count, size_t max_length, scan_kind kind,
+                       std::vector<cl::Event> const& wait_list)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::LocalSpaceArg
+            , unsigned int >(program.kernel("batched_scan_offsets"));
+    if (count == 0) {
+        return enqueue_marker(wait_list);
+    }
+    size_t const group_size = batch_group_size(program, max_length);
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(queue, wait_list, cl::NDRange(count * group_size), cl::NDRange(group_size));
+    return kernel(enqueue_args, input, output, offsets, cl::Local(program.element_size * local_entries(program, next_power_of_two(group_size))),
+                  kind == scan_kind::exclusive);
+}
+
+cl::Event apply_carry(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                      cl::Buffer carry_in, cl::Buffer carry_out, size_t size, size_t output_offset,
+                      bool first, std::vector<cl::Event> const& wait_list,
+                      cl::CommandQueue command_queue)
+{
+    auto kernel = cl::make_kernel< cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , cl::Buffer&
+            , unsigned int
+            , unsigned int
+            , unsigned int >(program.kernel("apply_carry"));
+
+    size_t const global_size = blocks_count(size, program.block_size) * program.block_size;
+
+    cl::EnqueueArgs enqueue_args = cl::EnqueueArgs(command_queue, wait_list, cl::NDRange(global_size), cl::NDRange(program.block_size));
+    return kernel(enqueue_args, input, output, carry_in, carry_out, size, output_offset, first);
+}
+
+ScanPlan::ScanPlan(ScanProgram const& program, size_t input_size, scan_mode mode, scan_algorithm algorithm,
+                   scan_kind kind, cl::CommandQueue command_queue)
+    : program_(program)
+    , inner_(program.plain ? *program.plain : program)
+    , input_size_(input_size)
+    , mode_(mode)
+    , algorithm_(algorithm)
+    , exclusive_(kind == scan_kind::exclusive)
+    , queue_(command_queue)
+    , top_size_(0)
+{
+    check_exclusive(algorithm_, exclusive_);
+
+    if (mode_ == scan_mode::single_pass) {
+        size_t const tiles = blocks_count(input_size_, tile_size(program, scan_algorithm::blelloch));
+        output_ = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * input_size_);
+        flags_ = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * (tiles + 1));
+        aggregates_ = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * tiles);
+        prefixes_ = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * tiles);
+        return;
+    }
+
+    size_t size = input_size_;
+    while (size > tile_size(level_program(levels_.size()), algorithm_)) {
+        size_t const tile = tile_size(level_program(levels_.size()), algorithm_);
+        Level level;
+        level.size = size;
+        level.output = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * size);
+        level.last_elements = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * blocks_count(size, tile));
+        levels_.push_back(level);
+        size = blocks_count(size, tile);
+    }
+    top_size_ = size;
+    top_output_ = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * top_size_);
+    output_ = levels_.empty() ? top_output_ : levels_.front().output;
+}
+
+cl::Event ScanPlan::enqueue(cl::Buffer input, std::vector<cl::Event> const& wait_list)
+{
+    if (mode_ == scan_mode::single_pass) {
+        return single_pass_scan(program_, input, output_, flags_, aggregates_, prefixes_, input_size_,
+                                exclusive_, wait_list, queue_);
+    }
+
+    // only the first level produces the exclusive result, the block totals
+    // above it are always scanned inclusively
+    std::vector<cl::Event> previous(wait_list);
+    bool exclusive = exclusive_;
+    for (size_t k = 0; k < levels_.size(); k++) {
+        previous.assign(1, subblock_scan(level_program(k), input, levels_[k].output, levels_[k].last_elements,
+                                         levels_[k].size, algorithm_, exclusive, previous, queue_));
+        input = levels_[k].last_elements;
+        exclusive = false;
+    }
+    previous.assign(1, small_array_scan(level_program(levels_.size()), input, top_output_, top_size_, algorithm_,
+                                        exclusive, previous, queue_));
+
+    cl::Buffer additions = top_output_;
+    for (size_t k = levels_.size(); k-- > 0; ) {
+        ScanProgram const& program = level_program(k);
+        previous.assign(1, merge(program, levels_[k].output, levels_[k].output, additions, levels_[k].size,
+                                 tile_size(program, algorithm_), previous, queue_));
+        additions = levels_[k].output;
+    }
+    return previous.front();
+}
+
+cl::Buffer ScanPlan::execute(cl::Buffer input)
+{
+    enqueue(input).wait();
+    return output_;
+}
+
+cl::Buffer inclusive_scan(cl::Buffer input, size_t input_size, scan_algorithm algorithm)
+{
+    return ScanPlan(scan_program<cl_float, scan_add>(), input_size, selected_scan_mode, algorithm).execute(input);
+}
+
+// The plan's buffers outlive it: OpenCL keeps memory objects alive until the
+// commands using them have finished.
+cl::Event inclusive_scan_async(cl::Buffer input, size_t input_size, cl::Buffer& output,
+                               std::vector<cl::Event> const& wait_list)
+{
+    ScanPlan plan(scan_program<cl_float, scan_add>(), input_size);
+    output = plan.output();
+    return plan.enqueue(input, wait_list);
+}
+
+SegmentedScanPlan::SegmentedScanPlan(ScanProgram const& program, size_t input_size, scan_kind kind)
+    : program_(program)
+    , input_size_(input_size)
+    , exclusive_(kind == scan_kind::exclusive)
+    , top_size_(0)
+{
+    size_t const tile = tile_size(program, scan_algorithm::blelloch);
+    size_t size = input_size_;
+    while (size > tile) {
+        Level level;
+        size_t const tiles = blocks_count(size, tile);
+        level.size = size;
+        level.output = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * size);
+        level.seen = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * size);
+        level.last_elements = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * tiles);
+        level.last_heads = cl::Buffer(context, CL_MEM_READ_WRITE, sizeof(cl_uint) * tiles);
+        levels_.push_back(level);
+        size = tiles;
+    }
+    top_size_ = size;
+    top_output_ = cl::Buffer(context, CL_MEM_READ_WRITE, program.element_size * top_size_);
+    output_ = levels_.empty() ? top_output_ : levels_.front().output;
+}
+
+cl::Event SegmentedScanPlan::enqueue(cl::Buffer input, cl::Buffer heads, std::vector<cl::Event> const& wait_list)
+{
+    std::vector<cl::Event> previous(wait_list);
+    bool exclusive = exclusive_;
+    for (Level const& level: levels_) {
+        previous.assign(1, subblock_segmented_scan(program_, input, heads, level.output, level.seen,
+                                                   level.last_elements, level.last_heads,
+                                                   level.size, exclusive, previous));
+        input = level.last_elements;
+        heads = level.last_heads;
+        exclusive = false;
+    }
+    previous.assign(1, small_array_segmented_scan(program_, input, heads, top_output_, top_size_, exclusive, previous));
+
+    cl::Buffer additions = top_output_;
+    for (auto level = levels_.rbegin(); level != levels_.rend(); ++level) {
+        previous.assign(1, segmented_merge(program_, level->output, level->output, level->seen,
+                                           additions, level->size, previous));
+        additions = level->output;
+    }
+    return previous.front();
+}
+
+cl::Buffer SegmentedScanPlan::execute(cl::Buffer input, cl::Buffer heads)
+{
+    enqueue(input, heads).wait();
+    return output_;
+}
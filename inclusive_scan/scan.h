@@ -0,0 +1,431 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+#include <vector>
+#include <string>
+#include <map>
+#include <type_traits>
+
+// Elements per work-item in the blocked (Blelloch and single-pass) kernels,
+// passed to the program build as ITEMS_PER_THREAD.
+size_t const items_per_thread = 8;
+// Programs built while selected_bank_padding is set pad their local scan
+// arrays with one entry after every 2^log_num_banks, avoiding bank conflicts
+// of the strided tree accesses.
+size_t const log_num_banks = 5;
+extern bool selected_bank_padding;
+extern cl::Context context;
+extern cl::CommandQueue queue;
+
+// Scan kernels compiled for one element type and operator.
+struct ScanProgram
+{
+    cl::Program program;
+    // options the program was actually built with
+    std::string build_options;
+    size_t element_size;
+    // work-group size of the scan kernels, derived from device and kernel
+    // limits when the program is built
+    size_t block_size;
+    // built with the padded local layout
+    bool padded_local;
+    // every kernel of the program, created once at build time and shared by
+    // all copies; launches set all arguments right before enqueueing, so
+    // reuse is safe as long as one host thread launches at a time
+    std::map<std::string, cl::Kernel> kernels;
+    // for a program with fused transforms, the same scan without them, which
+    // scans the block totals above the first level; null otherwise
+    ScanProgram const* plain = nullptr;
+
+    // The named kernel; created afresh if it is not in kernels.
+    cl::Kernel kernel(std::string const& name) const;
+};
+
+// Remembers the kernel source and target devices; scan programs are built
+// from them on first use.
+void init_scan_programs(std::string const& source, std::vector<cl::Device> const& devices);
+
+// Options every scan program is built with, including the selected features.
+std::string scan_build_options();
+
+// Program built with scan_build_options() plus options, compiled once per
+// distinct option string and cached. A failed build prints the build log; if
+// built-in scans were selected, that program alone is rebuilt without them,
+// otherwise the error is rethrown. prelude is OpenCL C placed ahead of the
+// kernel source, e.g. the defines of fused transforms, and is part of the
+// cache key. A program with a prelude is built with the options its plain
+// one ended up with, so its failures are the prelude's and are rethrown.
+ScanProgram const& scan_program(std::string const& options, size_t element_size,
+                                std::string const& prelude = std::string());
+
+// Element types: OpenCL C name and the lowest/highest values, which are the
+// identities of max and min.
+template<typename T> struct scan_type;
+
+template<> struct scan_type<cl_float>
+{
+    static char const* name() { return "float"; }
+    static char const* lowest() { return "-INFINITY"; }
+    static char const* highest() { return "INFINITY"; }
+};
+
+template<> struct scan_type<cl_double>
+{
+    static char const* name() { return "double"; }
+    static char const* lowest() { return "-INFINITY"; }
+    static char const* highest() { return "INFINITY"; }
+};
+
+template<> struct scan_type<cl_int>
+{
+    static char const* name() { return "int"; }
+    static char const* lowest() { return "INT_MIN"; }
+    static char const* highest() { return "INT_MAX"; }
+};
+
+template<> struct scan_type<cl_uint>
+{
+    static char const* name() { return "uint"; }
+    static char const* lowest() { return "0"; }
+    static char const* highest() { return "UINT_MAX"; }
+};
+
+template<> struct scan_type<cl_long>
+{
+    static char const* name() { return "long"; }
+    static char const* lowest() { return "LONG_MIN"; }
+    static char const* highest() { return "LONG_MAX"; }
+};
+
+// Associative operators: the kernel define selecting them, their identity for
+// a given type and the host-side operation for reference scans.
+struct scan_add
+{
+    static char const* define() { return "SCAN_OP_ADD"; }
+    template<typename T> static char const* identity() { return "0"; }
+    template<typename T> T operator()(T a, T b) const { return a + b; }
+};
+
+struct scan_mul
+{
+    static char const* define() { return "SCAN_OP_MUL"; }
+    template<typename T> static char const* identity() { return "1"; }
+    template<typename T> T operator()(T a, T b) const { return a * b; }
+};
+
+struct scan_max
+{
+    static char const* define() { return "SCAN_OP_MAX"; }
+    template<typename T> static char const* identity() { return scan_type<T>::lowest(); }
+    template<typename T> T operator()(T a, T b) const { return a < b ? b : a; }
+};
+
+struct scan_min
+{
+    static char const* define() { return "SCAN_OP_MIN"; }
+    template<typename T> static char const* identity() { return scan_type<T>::highest(); }
+    template<typename T> T operator()(T a, T b) const { return b < a ? b : a; }
+};
+
+// Build options selecting element type T and operator Op.
+template<typename T, typename Op>
+std::string scan_type_options()
+{
+    std::string options = std::string(" -DSCAN_T=") + scan_type<T>::name()
+            + " -D" + Op::define()
+            + " -DSCAN_IDENTITY=" + Op::template identity<T>();
+    if (std::is_same<T, cl_double>::value) {
+        options += " -DSCAN_FP64";
+    }
+    if (sizeof(T) == 8) {
+        options += " -DSCAN_64BIT";
+    }
+    return options;
+}
+
+template<typename T, typename Op>
+ScanProgram const& scan_program()
+{
+    return scan_program(scan_type_options<T, Op>(), sizeof(T));
+}
+
+// Elementwise transforms fused into a scan, as OpenCL C expressions of the
+// element x, e.g. "x * x" or "x > 0 ? 1 : 0"; empty means unchanged. load
+// maps every input element as the first level reads it, so the mapped input
+// is never written to global memory, and store every result as the last
+// level writes it. In single-pass mode the raw scan never reaches global
+// memory either; three-phase mode writes it per tile and the merge applies
+// store. Both map T to T. Only ScanPlan
+// applies them; other launchers should get scan_program<T, Op>().
+struct ScanTransform
+{
+    std::string load;
+    std::string store;
+};
+
+template<typename T, typename Op>
+ScanProgram const& scan_program(ScanTransform const& transform)
+{
+    if (transform.load.empty() && transform.store.empty()) {
+        return scan_program<T, Op>();
+    }
+    std::string prelude;
+    if (!transform.load.empty()) {
+        prelude += "#define SCAN_LOAD(x) ((T)(" + transform.load + "))\n";
+    }
+    if (!transform.store.empty()) {
+        prelude += "#define SCAN_STORE(x) ((T)(" + transform.store + "))\n";
+    }
+    return scan_program(scan_type_options<T, Op>(), sizeof(T), prelude);
+}
+
+enum class scan_algorithm
+{
+    hillis_steele, // O(n log n) additions, two ping-pong local buffers
+    blelloch       // work-efficient up-sweep/down-sweep, one local buffer
+};
+
+enum class scan_mode
+{
+    three_phase, // subblock_scan, recursive scan of the block sums, merge
+    single_pass  // decoupled look-back, one launch for any input size
+};
+
+enum class scan_kind
+{
+    inclusive, // element i includes input[i]
+    exclusive  // element i covers input[0..i), element 0 is the identity
+};
+
+extern scan_mode selected_scan_mode;
+
+scan_mode select_scan_mode(cl::Device const& device);
+
+// Built-in collective scans a device offers. Programs built while they are
+// selected use them in place of the local-memory trees for add, max and min.
+struct ScanFeatures
+{
+    bool work_group_scan; // work_group_scan_*, OpenCL C 2.0, optional in 3.0
+    bool sub_group_scan;  // sub_group_scan_*, cl_khr_subgroups or cl_intel_subgroups
+    bool opencl_c_3;      // build as OpenCL C 3.0 rather than 2.0 for work_group_scan
+};
+
+extern ScanFeatures selected_scan_features;
+
+ScanFeatures detect_scan_features(cl::Device const& device);
+
+size_t next_power_of_two(size_t x);
+
+// Elements covered by one work-group of the given algorithm.
+size_t tile_size(ScanProgram const& program, scan_algorithm algorithm);
+
+// Kernel launchers. All buffers are allocated by the caller. Each launcher
+// enqueues behind wait_list, on command_queue where it takes one, and
+// returns the kernel's event without blocking.
+// exclusive is only supported by the blelloch algorithm.
+cl::Event small_array_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output, size_t input_size,
+                           scan_algorithm algorithm, bool exclusive, std::vector<cl::Event> const& wait_list,
+                           cl::CommandQueue command_queue = queue);
+cl::Event subblock_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output, cl::Buffer last_elements,
+                        size_t input_size, scan_algorithm algorithm, bool exclusive,
+                        std::vector<cl::Event> const& wait_list,
+                        cl::CommandQueue command_queue = queue);
+cl::Event merge(ScanProgram const& program, cl::Buffer input, cl::Buffer output, cl::Buffer additions,
+                size_t input_size, size_t tile, std::vector<cl::Event> const& wait_list,
+                cl::CommandQueue command_queue = queue);
+cl::Event single_pass_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                           cl::Buffer flags, cl::Buffer aggregates, cl::Buffer prefixes,
+                           size_t input_size, bool exclusive, std::vector<cl::Event> const& wait_list,
+                           cl::CommandQueue command_queue = queue);
+
+// Segmented launchers: heads has one cl_uint per element, non-zero where a
+// segment starts. seen receives, per element, whether a segment starts at or
+// before it within its tile; segmented_merge stops the carry there.
+cl::Event small_array_segmented_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer heads,
+                                     cl::Buffer output, size_t input_size, bool exclusive,
+                                     std::vector<cl::Event> const& wait_list);
+cl::Event subblock_segmented_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer heads,
+                                  cl::Buffer output, cl::Buffer seen,
+                                  cl::Buffer last_elements, cl::Buffer last_heads,
+                                  size_t input_size, bool exclusive,
+                                  std::vector<cl::Event> const& wait_list);
+cl::Event segmented_merge(ScanProgram const& program, cl::Buffer input, cl::Buffer output, cl::Buffer seen,
+                          cl::Buffer additions, size_t input_size, std::vector<cl::Event> const& wait_list);
+
+// Batched scans of count independent arrays in one launch, one work-group
+// per array. The strided form scans length elements starting at k * stride;
+// the offsets form scans [offsets[k], offsets[k + 1]) with offsets holding
+// count + 1 cl_uints, and max_length bounding the lengths for work-group
+// sizing only. Arrays of any length work, output may equal input. A count
+// of 0 enqueues only a marker behind wait_list.
+cl::Event batched_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                       size_t count, size_t stride, size_t length, scan_kind kind,
+                       std::vector<cl::Event> const& wait_list);
+cl::Event batched_scan(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                       cl::Buffer offsets, size_t count, size_t max_length, scan_kind kind,
+                       std::vector<cl::Event> const& wait_list);
+
+// Combines carry_in[0] into every element of an already scanned chunk,
+// writes the result to output from output_offset on and the chunk's new last
+// element to carry_out[0], so consecutive chunks form one scan. input may
+// equal output. first skips carry_in. carry_in and carry_out must differ.
+cl::Event apply_carry(ScanProgram const& program, cl::Buffer input, cl::Buffer output,
+                      cl::Buffer carry_in, cl::Buffer carry_out, size_t size, size_t output_offset,
+                      bool first, std::vector<cl::Event> const& wait_list,
+                      cl::CommandQueue command_queue = queue);
+
+// Inclusive scan of a fixed number of elements. The level hierarchy and all
+// intermediate buffers are set up once in the constructor, so repeated
+// execute() calls do not allocate.
+class ScanPlan
+{
+public:
+    ScanPlan(ScanProgram const& program, size_t input_size,
+             scan_mode mode = selected_scan_mode,
+             scan_algorithm algorithm = scan_algorithm::blelloch,
+             scan_kind kind = scan_kind::inclusive,
+             cl::CommandQueue command_queue = queue);
+
+    // Enqueues the whole scan behind wait_list without blocking the host.
+    // The returned event completes when output() holds the result. Scans
+    // through one plan share its buffers, so on an out-of-order queue the
+    // caller has to chain them.
+    cl::Event enqueue(cl::Buffer input,
+                      std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+    // Blocking enqueue(). The result lives in a buffer owned by the plan and
+    // is overwritten by the next scan.
+    cl::Buffer execute(cl::Buffer input);
+
+    cl::Buffer output() const { return output_; }
+    size_t input_size() const { return input_size_; }
+
+private:
+    struct Level
+    {
+        size_t size;              // elements scanned at this level
+        cl::Buffer output;        // block-wise scan, merged in place
+        cl::Buffer last_elements; // block totals, input of the next level
+    };
+
+    // Level k reads the input and writes the output through program_'s fused
+    // transforms if k is 0, the block totals above it plainly.
+    ScanProgram const& level_program(size_t k) const { return k == 0 ? program_ : inner_; }
+
+    ScanProgram program_;
+    ScanProgram inner_;
+    size_t input_size_;
+    scan_mode mode_;
+    scan_algorithm algorithm_;
+    bool exclusive_;
+    cl::CommandQueue queue_;
+    cl::Buffer output_;
+
+    // three-phase: one Level per subblock_scan, then small_array_scan of
+    // top_size_ elements into top_output_
+    std::vector<Level> levels_;
+    size_t top_size_;
+    cl::Buffer top_output_;
+
+    // single-pass
+    cl::Buffer flags_;
+    cl::Buffer aggregates_;
+    cl::Buffer prefixes_;
+};
+
+// Segmented scan of a fixed number of elements over the three-phase
+// hierarchy: every level carries head flags next to the values, so any
+// number of segments is scanned with one launch per level.
+class SegmentedScanPlan
+{
+public:
+    SegmentedScanPlan(ScanProgram const& program, size_t input_size,
+                      scan_kind kind = scan_kind::inclusive);
+
+    cl::Event enqueue(cl::Buffer input, cl::Buffer heads,
+                      std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+    cl::Buffer execute(cl::Buffer input, cl::Buffer heads);
+
+    cl::Buffer output() const { return output_; }
+    size_t input_size() const { return input_size_; }
+
+private:
+    struct Level
+    {
+        size_t size;
+        cl::Buffer output;
+        cl::Buffer seen;
+        cl::Buffer last_elements;
+        cl::Buffer last_heads;    // whether a segment starts inside the block
+    };
+
+    ScanProgram program_;
+    size_t input_size_;
+    bool exclusive_;
+    cl::Buffer output_;
+    std::vector<Level> levels_;
+    size_t top_size_;
+    cl::Buffer top_output_;
+};
+
+// Scan of input_size elements of type T under Op, e.g.
+// inclusive_scan<cl_int, scan_max>(buffer, n).
+template<typename T, typename Op = scan_add>
+cl::Buffer inclusive_scan(cl::Buffer input, size_t input_size)
+{
+    return ScanPlan(scan_program<T, Op>(), input_size).execute(input);
+}
+
+template<typename T, typename Op = scan_add>
+cl::Buffer exclusive_scan(cl::Buffer input, size_t input_size)
+{
+    return ScanPlan(scan_program<T, Op>(), input_size, selected_scan_mode,
+                    scan_algorithm::blelloch, scan_kind::exclusive).execute(input);
+}
+
+// Map, scan and map in one pass over global memory, e.g.
+// transform_scan<cl_int>(buffer, n, {"x > 0 ? 1 : 0", ""}) counts positives.
+template<typename T, typename Op = scan_add>
+cl::Buffer transform_scan(cl::Buffer input, size_t input_size, ScanTransform const& transform,
+                          scan_kind kind = scan_kind::inclusive)
+{
+    return ScanPlan(scan_program<T, Op>(transform), input_size, selected_scan_mode,
+                    scan_algorithm::blelloch, kind).execute(input);
+}
+
+template<typename T, typename Op = scan_add>
+cl::Buffer segmented_scan(cl::Buffer input, cl::Buffer heads, size_t input_size,
+                          scan_kind kind = scan_kind::inclusive)
+{
+    return SegmentedScanPlan(scan_program<T, Op>(), input_size, kind).execute(input, heads);
+}
+
+template<typename T, typename Op = scan_add>
+cl::Event batched_scan(cl::Buffer input, cl::Buffer output, size_t count, size_t stride, size_t length,
+                       scan_kind kind = scan_kind::inclusive,
+                       std::vector<cl::Event> const& wait_list = std::vector<cl::Event>())
+{
+    return batched_scan(scan_program<T, Op>(), input, output, count, stride, length, kind, wait_list);
+}
+
+template<typename T, typename Op = scan_add>
+cl::Event batched_scan(cl::Buffer input, cl::Buffer output, cl::Buffer offsets, size_t count, size_t max_length,
+                       scan_kind kind = scan_kind::inclusive,
+                       std::vector<cl::Event> const& wait_list = std::vector<cl::Event>())
+{
+    return batched_scan(scan_program<T, Op>(), input, output, offsets, count, max_length, kind, wait_list);
+}
+
+// Float sum scan.
+cl::Buffer inclusive_scan(cl::Buffer input, size_t input_size,
+                          scan_algorithm algorithm = scan_algorithm::blelloch);
+
+// Non-blocking inclusive_scan(): output receives the result buffer, which is
+// valid once the returned event completes.
+cl::Event inclusive_scan_async(cl::Buffer input, size_t input_size, cl::Buffer& output,
+                               std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+#endif // SCAN_H
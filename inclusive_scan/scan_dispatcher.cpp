@@ -0,0 +1,68 @@
+#include "scan_dispatcher.h"
+
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <limits>
+
+static std::string device_key(cl::Device const& device)
+{
+    return device.getInfo<CL_DEVICE_NAME>() + " / " + device.getInfo<CL_DRIVER_VERSION>();
+}
+
+ScanDispatcher::ScanDispatcher(std::string const& cache_file)
+{
+    std::string const key = device_key(queue.getInfo<CL_QUEUE_DEVICE>());
+
+    // one "<crossover> <device key>" line per device
+    std::ifstream cache(cache_file);
+    size_t crossover;
+    std::string line_key;
+    while (cache >> crossover && std::getline(cache >> std::ws, line_key)) {
+        if (line_key == key) {
+            crossover_ = crossover;
+            return;
+        }
+    }
+
+    crossover_ = calibrate();
+    std::ofstream(cache_file, std::ios::app) << crossover_ << " " << key << std::endl;
+}
+
+template<typename F>
+static double average_seconds(F scan, int iterations)
+{
+    scan();
+    auto start = std::chrono::high_resolution_clock::now();
+    for (int i = 0; i < iterations; i++) {
+        scan();
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count() / iterations;
+}
+
+size_t ScanDispatcher::calibrate()
+{
+    size_t const max_size = 1 << 24;
+    int const iterations = 10;
+
+    std::vector<size_t> sizes;
+    for (size_t size = 16; size <= max_size; size *= 4) {
+        sizes.push_back(size);
+    }
+
+    // walk down from the largest size while the device keeps winning, so a
+    // noisy win at some small size does not move the crossover below a loss
+    size_t crossover = std::numeric_limits<size_t>::max();
+    for (auto size = sizes.rbegin(); size != sizes.rend(); ++size) {
+        std::vector<float> input(*size, 1.0f);
+        double const host = average_seconds([&]{ host_scan<cl_float>(input); }, iterations);
+        double const device = average_seconds([&]{ device_scan<cl_float>(input); }, iterations);
+        if (device >= host) {
+            break;
+        }
+        crossover = *size;
+    }
+    std::cout << "scan crossover: " << crossover << std::endl;
+    return crossover;
+}
@@ -0,0 +1,54 @@
+#ifndef SCAN_DISPATCHER_H
+#define SCAN_DISPATCHER_H
+
+#include "scan.h"
+#include "cpu_scan.h"
+
+// Scans host arrays on the host below a crossover size and on the device
+// from it on. The crossover is measured once per device, as the size from
+// which an upload, scan and download beat cpu_scan(), and kept in a cache
+// file keyed by device name and driver version.
+class ScanDispatcher
+{
+public:
+    explicit ScanDispatcher(std::string const& cache_file = "scan_crossover.txt");
+
+    // Smallest size scanned on the device.
+    size_t crossover() const { return crossover_; }
+
+    template<typename T, typename Op = scan_add>
+    std::vector<T> inclusive_scan(std::vector<T> const& input) const
+    {
+        return input.size() < crossover_ ? host_scan<T, Op>(input) : device_scan<T, Op>(input);
+    }
+
+    template<typename T, typename Op = scan_add>
+    static std::vector<T> host_scan(std::vector<T> const& input)
+    {
+        return cpu_scan<T, Op>(input);
+    }
+
+    // Upload, scan through a fresh plan and download.
+    template<typename T, typename Op = scan_add>
+    static std::vector<T> device_scan(std::vector<T> const& input)
+    {
+        std::vector<T> output(input.size());
+        if (input.empty()) {
+            return output;
+        }
+        cl::Buffer dev_input(context, CL_MEM_READ_ONLY, sizeof(T) * input.size());
+        queue.enqueueWriteBuffer(dev_input, CL_FALSE, 0, sizeof(T) * input.size(), &input[0]);
+        ScanPlan plan(scan_program<T, Op>(), input.size());
+        plan.enqueue(dev_input);
+        queue.enqueueReadBuffer(plan.output(), CL_TRUE, 0, sizeof(T) * output.size(), &output[0]);
+        return output;
+    }
+
+private:
+    // Times float sums of growing size both ways.
+    static size_t calibrate();
+
+    size_t crossover_;
+};
+
+#endif // SCAN_DISPATCHER_H
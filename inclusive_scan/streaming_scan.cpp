@@ -0,0 +1,160 @@
+#include "streaming_scan.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+size_t default_chunk_size(cl::Device const& device, ScanProgram const& program)
+{
+    // Each slot holds an input chunk and its scan, plus block totals that are
+    // small next to them, and run() adds a plan for a shorter last chunk, so
+    // up to five chunks are resident; a quarter of the device memory for
+    // them leaves the rest to other users.
+    cl_ulong const budget = std::min(device.getInfo<CL_DEVICE_GLOBAL_MEM_SIZE>() / 20,
+                                     device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>());
+    size_t const tile = tile_size(program, scan_algorithm::blelloch);
+    // the kernels index with uint
+    size_t const chunk = std::min<cl_ulong>(budget / program.element_size, cl_ulong(1) << 30);
+    return std::max(tile, chunk / tile * tile);
+}
+
+StreamingScan::StreamingScan(ScanProgram const& program, size_t chunk_size)
+    : program_(program)
+    , chunk_size_(chunk_size)
+{
+    cl::Device const device = queue.getInfo<CL_QUEUE_DEVICE>();
+    if (chunk_size_ == 0) {
+        chunk_size_ = default_chunk_size(device, program_);
+    }
+    transfer_queue_ = cl::CommandQueue(context, device);
+
+    for (size_t slot = 0; slot < 2; slot++) {
+        inputs_[slot] = cl::Buffer(context, CL_MEM_READ_ONLY, program_.element_size * chunk_size_);
+        plans_.emplace_back(program_, chunk_size_);
+        carries_[slot] = cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size);
+    }
+}
+
+void StreamingScan::run(void const* input, void* output, size_t size)
+{
+    char const* host_input = static_cast<char const*>(input);
+    char* host_output = static_cast<char*>(output);
+    size_t const element_size = program_.element_size;
+    size_t const chunks = size / chunk_size_ + ((size % chunk_size_)?1:0);
+
+    // A shorter last chunk gets a plan of its own size.
+    std::vector<ScanPlan> tail_plan;
+    if (size % chunk_size_) {
+        tail_plan.emplace_back(program_, size % chunk_size_);
+    }
+
+    cl::Event uploaded[2];
+    cl::Event scanned[2];   // carry applied, chunk complete on the device
+    cl::Event downloaded[2];
+
+    auto upload = [&](size_t k) {
+        size_t const slot = k % 2;
+        size_t const length = std::min(chunk_size_, size - k * chunk_size_);
+        // the slot's input buffer is free once chunk k - 2 is scanned
+        std::vector<cl::Event> wait_list;
+        if (k >= 2) {
+            wait_list.push_back(scanned[slot]);
+        }
+        transfer_queue_.enqueueWriteBuffer(inputs_[slot], CL_FALSE, 0, element_size * length,
+                                           host_input + element_size * k * chunk_size_,
+                                           &wait_list, &uploaded[slot]);
+        // queue waits on this upload
+        transfer_queue_.flush();
+    };
+
+    if (chunks > 0) {
+        upload(0);
+    }
+    for (size_t k = 0; k < chunks; k++) {
+        size_t const slot = k % 2;
+        size_t const length = std::min(chunk_size_, size - k * chunk_size_);
+        ScanPlan& plan = length < chunk_size_ ? tail_plan[0] : plans_[slot];
+
+        if (k + 1 < chunks) {
+            upload(k + 1);
+        }
+
+        // the plan's output is free once chunk k - 2 is downloaded
+        std::vector<cl::Event> wait_list(1, uploaded[slot]);
+        if (k >= 2) {
+            wait_list.push_back(downloaded[slot]);
+        }
+        std::vector<cl::Event> carry_wait_list(1, plan.enqueue(inputs_[slot], wait_list));
+        // chunk k - 1 writes the carry read here and reads the one written here
+        if (k >= 1) {
+            carry_wait_list.push_back(scanned[1 - slot]);
+        }
+        scanned[slot] = apply_carry(program_, plan.output(), plan.output(), carries_[slot], carries_[1 - slot],
+                                    length, 0, k == 0, carry_wait_list);
+        // transfer_queue_ waits on the scan, both for the download and for
+        // the upload of chunk k + 2 into this slot
+        queue.flush();
+
+        std::vector<cl::Event> download_wait_list(1, scanned[slot]);
+        transfer_queue_.enqueueReadBuffer(plan.output(), CL_FALSE, 0, element_size * length,
+                                          host_output + element_size * k * chunk_size_,
+                                          &download_wait_list, &downloaded[slot]);
+    }
+    transfer_queue_.finish();
+}
+
+AppendScan::AppendScan(ScanProgram const& program)
+    : program_(program)
+    , size_(0)
+    , carry_(0)
+{
+    for (size_t i = 0; i < 2; i++) {
+        carries_[i] = cl::Buffer(context, CL_MEM_READ_WRITE, program_.element_size);
+    }
+}
+
+std::vector<cl::Event> AppendScan::after_last(std::vector<cl::Event> const& wait_list) const
+{
+    std::vector<cl::Event> result(wait_list);
+    if (last_() != nullptr) {
+        result.push_back(last_);
+    }
+    return result;
+}
+
+cl::Event AppendScan::resume(cl::Buffer prefix, size_t size, std::vector<cl::Event> const& wait_list)
+{
+    if (size == 0) throw std::invalid_argument("empty prefix");
+
+    std::vector<cl::Event> copy_wait_list = after_last(wait_list);
+    queue.enqueueCopyBuffer(prefix, carries_[carry_], program_.element_size * (size - 1), 0,
+                            program_.element_size, &copy_wait_list, &last_);
+    size_ = size;
+    return last_;
+}
+
+cl::Event AppendScan::append(cl::Buffer input, size_t count, cl::Buffer output, size_t output_offset,
+                             std::vector<cl::Event> const& wait_list)
+{
+    if (count == 0) throw std::invalid_argument("empty block");
+
+    auto plan = std::find_if(plans_.begin(), plans_.end(),
+                             [count](std::pair<size_t, ScanPlan> const& p) { return p.first == count; });
+    if (plan != plans_.end()) {
+        std::rotate(plan, plan + 1, plans_.end());
+    } else {
+        // buffers of an evicted plan are released once its commands finish
+        if (plans_.size() == append_plans) {
+            plans_.erase(plans_.begin());
+        }
+        plans_.emplace_back(count, ScanPlan(program_, count));
+    }
+    plan = plans_.end() - 1;
+
+    // the plan's output may still be read by an earlier append of this size
+    std::vector<cl::Event> carry_wait_list(1, plan->second.enqueue(input, after_last(wait_list)));
+    last_ = apply_carry(program_, plan->second.output(), output, carries_[carry_], carries_[1 - carry_],
+                        count, output_offset, size_ == 0, carry_wait_list);
+    carry_ = 1 - carry_;
+    size_ += count;
+    return last_;
+}
@@ -0,0 +1,85 @@
+#ifndef STREAMING_SCAN_H
+#define STREAMING_SCAN_H
+
+#include "scan.h"
+
+#include <utility>
+
+// Chunk size, in elements, that lets two chunks and their scans stay
+// resident on the device with room to spare. A multiple of the tile size.
+size_t default_chunk_size(cl::Device const& device, ScanProgram const& program);
+
+// Inclusive scan of host arrays larger than device memory. The input is
+// streamed through the device in chunks: chunk k + 1 is uploaded on a
+// separate transfer queue while chunk k is scanned, and the running total
+// is carried from chunk to chunk on the device, so the host never waits for
+// anything but the final download.
+class StreamingScan
+{
+public:
+    // chunk_size of 0 picks default_chunk_size() for the queue's device.
+    StreamingScan(ScanProgram const& program, size_t chunk_size = 0);
+
+    // Scans size elements of input into output, which may be the same
+    // array, and blocks until output is written.
+    void run(void const* input, void* output, size_t size);
+
+    size_t chunk_size() const { return chunk_size_; }
+
+private:
+    ScanProgram program_;
+    size_t chunk_size_;
+    cl::CommandQueue transfer_queue_;
+
+    // two slots, chunk k uses slot k % 2
+    cl::Buffer inputs_[2];
+    std::vector<ScanPlan> plans_;
+    // running totals, chunk k reads carries_[k % 2] and writes the other one
+    cl::Buffer carries_[2];
+};
+
+// Block sizes an AppendScan keeps a plan, and its buffers, for; the least
+// recently used one is dropped beyond that.
+size_t const append_plans = 8;
+
+// Inclusive scan of a series that grows by appended blocks. Only the running
+// total of the series so far is kept, on the device, and each append scans
+// just the new block offset by it, so a stream of appends costs O(new data).
+class AppendScan
+{
+public:
+    explicit AppendScan(ScanProgram const& program);
+
+    // Continues a series whose inclusive scan of size elements is in prefix,
+    // e.g. the result of inclusive_scan().
+    cl::Event resume(cl::Buffer prefix, size_t size,
+                     std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+    // Scans count elements of input as the next block of the series into
+    // output from output_offset on. Appends and resumes run in call order.
+    cl::Event append(cl::Buffer input, size_t count, cl::Buffer output, size_t output_offset,
+                     std::vector<cl::Event> const& wait_list = std::vector<cl::Event>());
+
+    // Elements in the series so far.
+    size_t size() const { return size_; }
+
+private:
+    std::vector<cl::Event> after_last(std::vector<cl::Event> const& wait_list) const;
+
+    ScanProgram program_;
+    size_t size_;
+    // by block size, most recently used last
+    std::vector<std::pair<size_t, ScanPlan>> plans_;
+    cl::Buffer carries_[2];
+    size_t carry_;                     // carries_[carry_] holds the total
+    cl::Event last_;
+};
+
+template<typename T, typename Op = scan_add>
+void streaming_scan(std::vector<T> const& input, std::vector<T>& output, size_t chunk_size = 0)
+{
+    output.resize(input.size());
+    StreamingScan(scan_program<T, Op>(), chunk_size).run(input.data(), output.data(), input.size());
+}
+
+#endif // STREAMING_SCAN_H
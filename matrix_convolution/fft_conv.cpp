@@ -0,0 +1,98 @@
+#include "fft_conv.h"
+
+#include <algorithm>
+#include <complex>
+
+int fft_size(int N, int M)
+{
+    int P = 1;
+    while (P < N + (M - 1) / 2) P <<= 1;
+    return P;
+}
+
+static int log2_int(int x)
+{
+    int log = 0;
+    while ((1 << log) < x) ++log;
+    return log;
+}
+
+double direct_cost(int N, int M)
+{
+    double const taps = 2 * ((M - 1) / 2) + 1;
+    return double(N) * N * taps * taps;
+}
+
+double fft_cost(int N, int M)
+{
+    int const P = fft_size(N, M);
+    // P transforms of length P per dimension, P / 2 butterflies per stage
+    double const transform = 2.0 * P * (P / 2) * log2_int(P) * fft_butterfly_cost;
+    return 3 * transform + double(P) * P;
+}
+
+FftConvolution::FftConvolution(cl::Context const& context, cl::CommandQueue const& queue,
+                               cl::Program const& program, int N, int M)
+    : queue_(queue)
+    , N_(N)
+    , M_(M)
+    , P_(fft_size(N, M))
+    , load_signal_(program, "fft_load_signal")
+    , load_template_(program, "fft_load_template")
+    , radix2_(program, "fft_radix2")
+    , radix4_(program, "fft_radix4")
+    , multiply_(program, "fft_multiply")
+    , store_(program, "fft_store")
+{
+    size_t const bytes = sizeof(std::complex<float>) * P_ * P_;
+    for (int k = 0; k < 2; k++) {
+        signal_[k] = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+        template_[k] = cl::Buffer(context, CL_MEM_READ_WRITE, bytes);
+    }
+}
+
+cl::Buffer FftConvolution::transform(cl::Buffer data, cl::Buffer scratch, float sign, std::vector<cl::Event>& events)
+{
+    auto radix2 = cl::make_kernel< cl::Buffer&, cl::Buffer&, int, int, int, int, float >(radix2_);
+    auto radix4 = cl::make_kernel< cl::Buffer&, cl::Buffer&, int, int, int, int, float >(radix4_);
+
+    // rows: elements adjacent, transforms P apart; columns the other way round
+    int const strides[] = {1, P_};
+    int const distances[] = {P_, 1};
+    for (int dimension = 0; dimension < 2; dimension++) {
+        for (int p = 1; p < P_; ) {
+            int const radix = (P_ / p) % 4 == 0 ? 4 : 2;
+            auto enqueue_args = cl::EnqueueArgs(queue_, cl::NDRange(P_ / radix, P_));
+            if (radix == 4) {
+                events.push_back(radix4(enqueue_args, data, scratch, P_, p, strides[dimension], distances[dimension], sign));
+            } else {
+                events.push_back(radix2(enqueue_args, data, scratch, P_, p, strides[dimension], distances[dimension], sign));
+            }
+            std::swap(data, scratch);
+            p *= radix;
+        }
+    }
+    return data;
+}
+
+std::vector<cl::Event> FftConvolution::enqueue(cl::Buffer& a, cl::Buffer& b, cl::Buffer& c)
+{
+    auto load_signal = cl::make_kernel< cl::Buffer&, cl::Buffer&, int, int >(load_signal_);
+    auto load_template = cl::make_kernel< cl::Buffer&, cl::Buffer&, int, int >(load_template_);
+    auto multiply = cl::make_kernel< cl::Buffer&, cl::Buffer& >(multiply_);
+    auto store = cl::make_kernel< cl::Buffer&, cl::Buffer&, int, int >(store_);
+
+    std::vector<cl::Event> events;
+    auto padded = cl::EnqueueArgs(queue_, cl::NDRange(P_, P_));
+    events.push_back(load_signal(padded, a, signal_[0], N_, P_));
+    events.push_back(load_template(padded, b, template_[0], P_, M_));
+
+    cl::Buffer signal = transform(signal_[0], signal_[1], -1, events);
+    cl::Buffer filter = transform(template_[0], template_[1], -1, events);
+    events.push_back(multiply(cl::EnqueueArgs(queue_, cl::NDRange(P_ * P_)), signal, filter));
+
+    cl::Buffer other = signal() == signal_[0]() ? signal_[1] : signal_[0];
+    cl::Buffer result = transform(signal, other, 1, events);
+    events.push_back(store(cl::EnqueueArgs(queue_, cl::NDRange(N_, N_)), result, c, N_, P_));
+    return events;
+}
@@ -0,0 +1,62 @@
+#ifndef FFT_CONV_H
+#define FFT_CONV_H
+
+#define __CL_ENABLE_EXCEPTIONS
+#include "CL/cl.hpp"
+
+#include <vector>
+
+// Edge of the padded FFT arrays for an N x N signal and an M x M template:
+// the smallest power of two of at least N + (M - 1) / 2.
+int fft_size(int N, int M);
+
+// Rough costs in multiply-adds of convolving directly, M'^2 per element with
+// M' = 2 * ((M - 1) / 2) + 1 the taps used, and through three P x P
+// transforms plus the pointwise product. Every butterfly of a stage streams
+// the whole padded array through global memory, so it is weighted as
+// fft_butterfly_cost multiply-adds.
+double const fft_butterfly_cost = 8;
+double direct_cost(int N, int M);
+double fft_cost(int N, int M);
+
+inline bool prefer_fft(int N, int M)
+{
+    return fft_cost(N, M) < direct_cost(N, M);
+}
+
+// Convolution with matrix_conv's result, zero padding included, computed as
+// the inverse FFT of the product of the padded signal's and the flipped
+// template's transforms. Transforms are radix-4 Stockham stages with a
+// radix-2 one for odd powers of two, rows first, then columns.
+class FftConvolution
+{
+public:
+    FftConvolution(cl::Context const& context, cl::CommandQueue const& queue, cl::Program const& program,
+                   int N, int M);
+
+    // Convolves the N x N signal a with the M x M template b into c. The
+    // returned events are the commands in launch order.
+    std::vector<cl::Event> enqueue(cl::Buffer& a, cl::Buffer& b, cl::Buffer& c);
+
+    int size() const { return P_; }
+
+private:
+    // Transforms the P x P array in data, ping-ponging with scratch, and
+    // returns the buffer holding the result.
+    cl::Buffer transform(cl::Buffer data, cl::Buffer scratch, float sign, std::vector<cl::Event>& events);
+
+    cl::CommandQueue queue_;
+    int N_;
+    int M_;
+    int P_;
+    cl::Kernel load_signal_;
+    cl::Kernel load_template_;
+    cl::Kernel radix2_;
+    cl::Kernel radix4_;
+    cl::Kernel multiply_;
+    cl::Kernel store_;
+    cl::Buffer signal_[2];
+    cl::Buffer template_[2];
+};
+
+#endif // FFT_CONV_H
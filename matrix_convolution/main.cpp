@@ -2,6 +2,8 @@
 #define __CL_ENABLE_EXCEPTIONS
 #include "CL/cl.hpp"
 
+#include "fft_conv.h"
+
 #include <iostream>
 #include <fstream>
 #include <vector>
@@ -11,6 +13,10 @@
 #include <random>
 #include <chrono>
 #include <algorithm>
+#include <functional>
+#include <cmath>
+#include <map>
+#include <memory>
 
 cl::Platform selectPlatform()
 {
@@ -70,6 +76,112 @@ cl::Device selectDevice(std::vector<cl::Device> const& devices)
     return devices[i];
 }
 
+// Work-groups beyond this many work-items only add to the scheduling
+// granularity of the convolution.
+size_t const max_group_items = 256;
+
+// Edge of the square work-group kernel is launched with on device: the
+// largest edge whose square fits the device and kernel limits,
+// max_group_items and the local memory left after the kernel's own usage,
+// rounded down to one whose square is a multiple of the kernel's preferred
+// work-group size multiple when such an edge fits. The kernels take any edge.
+size_t select_block_size(cl::Kernel const& kernel, cl::Device const& device)
+{
+    std::vector<size_t> const item_sizes = device.getInfo<CL_DEVICE_MAX_WORK_ITEM_SIZES>();
+    size_t const limit = std::min({max_group_items,
+                                   device.getInfo<CL_DEVICE_MAX_WORK_GROUP_SIZE>(),
+                                   kernel.getWorkGroupInfo<CL_KERNEL_WORK_GROUP_SIZE>(device)});
+    size_t const edge_limit = std::min(item_sizes[0], item_sizes[1]);
+    bool const fits_local = kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device)
+            <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+
+    size_t edge = 1;
+    while (fits_local && (edge + 1) * (edge + 1) <= limit && edge + 1 <= edge_limit) {
+        edge++;
+    }
+
+    // the edges whose squares are multiples of preferred are the multiples
+    // of the smallest one
+    size_t const preferred = kernel.getWorkGroupInfo<CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE>(device);
+    size_t step = 1;
+    while ((step * step) % preferred != 0) {
+        step++;
+    }
+    if (edge >= step) {
+        return edge / step * step;
+    }
+    std::cout << "work-group of " << edge * edge << " is not a multiple of the preferred "
+              << preferred << std::endl;
+    return edge;
+}
+
+// Template sizes that get a program of their own, built with -DM=<size> so
+// the tap loops unroll; other sizes use the generic program.
+int const unrolled_sizes[] = {3, 5, 7, 9, 11, 13, 15};
+
+bool is_unrolled(int M)
+{
+    return std::find(std::begin(unrolled_sizes), std::end(unrolled_sizes), M) != std::end(unrolled_sizes);
+}
+
+// Programs built from the kernel source, one per distinct option string,
+// compiled on first use. A failed build prints the build log and rethrows.
+class ConvPrograms
+{
+public:
+    ConvPrograms(cl::Context const& context, std::vector<cl::Device> const& devices, std::string const& source)
+        : context_(context)
+        , devices_(devices)
+        , source_(source)
+    {
+    }
+
+    cl::Program const& get(std::string const& options)
+    {
+        auto cached = programs_.find(options);
+        if (cached != programs_.end()) {
+            return cached->second;
+        }
+
+        cl::Program::Sources source(1, std::make_pair(source_.c_str(), source_.length() + 1));
+        cl::Program program(context_, source);
+        try {
+            program.build(devices_, options.c_str());
+        }
+        catch (cl::Error const & e) {
+            for (cl::Device const& device: devices_) {
+                std::cout << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
+            }
+            throw;
+        }
+        return programs_[options] = program;
+    }
+
+    // Program for an M x M template: the unrolled variant if there is one
+    // for M and unrolled is set, the generic program otherwise. Templates
+    // that do not fit every device's constant buffer are read from __global.
+    cl::Program const& for_template(int M, bool unrolled = true)
+    {
+        std::string options;
+        if (unrolled && is_unrolled(M)) {
+            options += " -DM=" + std::to_string(M);
+        }
+        for (cl::Device const& device: devices_) {
+            if (sizeof(float) * M * M > device.getInfo<CL_DEVICE_MAX_CONSTANT_BUFFER_SIZE>()) {
+                options += " -DFILTER_SPACE=__global";
+                break;
+            }
+        }
+        return get(options);
+    }
+
+private:
+    cl::Context context_;
+    std::vector<cl::Device> devices_;
+    std::string source_;
+    std::map<std::string, cl::Program> programs_;
+};
+
 void generate_random_data(int N, int M, std::string filename) {
     std::uniform_real_distribution<float> distribution(-10.0, 10.0);
     unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
@@ -114,7 +226,265 @@ std::vector<float> cpu_conv(std::vector<float> A, std::vector<float> B, int N, i
     return C;
 }
 
-int main()
+// Largest deviation, relative to the largest entry of B, for which an
+// M x M template still counts as separable.
+float const separable_tolerance = 1e-5f;
+
+// Factors the taps of B that a convolution uses, the leading 2 * ((M - 1) / 2)
+// + 1 rows and columns, as u * v^T: u is the column of the entry of largest
+// magnitude and v its row scaled by 1 / that entry, which reproduces a rank-1
+// B exactly. Returns whether every tap is within separable_tolerance of the
+// product. u and v get M entries, unused ones zero.
+bool separate(std::vector<float> const& B, int M, std::vector<float>& u, std::vector<float>& v)
+{
+    int const taps = 2 * ((M - 1) / 2) + 1;
+    int p = 0;
+    int q = 0;
+    for (int i = 0; i < taps; i++) {
+        for (int j = 0; j < taps; j++) {
+            if (std::fabs(B[i * M + j]) > std::fabs(B[p * M + q])) {
+                p = i;
+                q = j;
+            }
+        }
+    }
+    float const pivot = B[p * M + q];
+
+    u.assign(M, 0.0f);
+    v.assign(M, 0.0f);
+    if (pivot == 0) {
+        return true;
+    }
+    for (int i = 0; i < taps; i++) {
+        u[i] = B[i * M + q];
+        v[i] = B[p * M + i] / pivot;
+    }
+    for (int i = 0; i < taps; i++) {
+        for (int j = 0; j < taps; j++) {
+            if (std::fabs(B[i * M + j] - u[i] * v[j]) > separable_tolerance * std::fabs(pivot)) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+std::vector<float> random_matrix(int size, std::default_random_engine& generator)
+{
+    std::uniform_real_distribution<float> distribution(-10.0, 10.0);
+    std::vector<float> matrix(size * size);
+    for (float& x: matrix) {
+        x = distribution(generator);
+    }
+    return matrix;
+}
+
+// Results agree up to float rounding of sums of up to M^2 products.
+bool conv_equal(std::vector<float> const& C, std::vector<float> const& expected)
+{
+    return std::equal(C.begin(), C.end(), expected.begin(), [](float x, float y) {
+        return std::fabs(x - y) <= 1e-3f * std::max(1.0f, std::max(std::fabs(x), std::fabs(y)));
+    });
+}
+
+// N x N work-items in square work-groups of block_size.
+cl::EnqueueArgs conv_range(cl::CommandQueue& queue, int N, size_t block_size)
+{
+    size_t const global_size = (N / block_size + ((N % block_size)?1:0)) * block_size;
+    return cl::EnqueueArgs(queue, cl::NDRange(global_size, global_size), cl::NDRange(block_size, block_size));
+}
+
+// Local memory matrix_conv_tiled takes for its block of A and the halo.
+size_t tile_bytes(size_t block_size, int M)
+{
+    size_t const edge = block_size + 2 * ((M - 1) / 2);
+    return sizeof(float) * edge * edge;
+}
+
+bool tile_fits(cl::Kernel const& kernel, cl::Device const& device, size_t block_size, int M)
+{
+    return kernel.getWorkGroupInfo<CL_KERNEL_LOCAL_MEM_SIZE>(device) + tile_bytes(block_size, M)
+            <= device.getInfo<CL_DEVICE_LOCAL_MEM_SIZE>();
+}
+
+cl::Event conv_naive(cl::CommandQueue& queue, cl::Kernel const& kernel, size_t block_size,
+                     cl::Buffer& a, cl::Buffer& b, cl::Buffer& c, int N, int M)
+{
+    auto matrix_conv = cl::make_kernel< cl::Buffer&
+                                      , cl::Buffer&
+                                      , cl::Buffer&
+                                      , int
+                                      , int >(kernel);
+    return matrix_conv(conv_range(queue, N, block_size), a, b, c, N, M);
+}
+
+cl::Event conv_tiled(cl::CommandQueue& queue, cl::Kernel const& kernel, size_t block_size,
+                     cl::Buffer& a, cl::Buffer& b, cl::Buffer& c, int N, int M)
+{
+    auto matrix_conv_tiled = cl::make_kernel< cl::Buffer&
+                                            , cl::Buffer&
+                                            , cl::Buffer&
+                                            , int
+                                            , int
+                                            , cl::LocalSpaceArg >(kernel);
+    return matrix_conv_tiled(conv_range(queue, N, block_size), a, b, c, N, M,
+                             cl::Local(tile_bytes(block_size, M)));
+}
+
+// Row pass of v into tmp, an N x N buffer, then column pass of u into c.
+std::vector<cl::Event> conv_separable(cl::CommandQueue& queue, cl::Kernel const& rows, cl::Kernel const& columns,
+                                      size_t block_size, cl::Buffer& a, cl::Buffer& u, cl::Buffer& v,
+                                      cl::Buffer& tmp, cl::Buffer& c, int N, int M)
+{
+    std::vector<cl::Event> events(1, conv_naive(queue, rows, block_size, a, v, tmp, N, M));
+    events.push_back(conv_naive(queue, columns, block_size, tmp, u, c, N, M));
+    return events;
+}
+
+// Device time from the start of the first to the end of the last of a
+// sequence of finished commands.
+double elapsed_ms(std::vector<cl::Event> const& events)
+{
+    cl_ulong const start = events.front().getProfilingInfo<CL_PROFILING_COMMAND_START>();
+    cl_ulong const end = events.back().getProfilingInfo<CL_PROFILING_COMMAND_END>();
+    return (end - start) * 1e-6;
+}
+
+// Every kernel on a 1024 x 1024 signal for templates from 3 x 3 to 64 x 64,
+// average device time per launch. Each size runs with a random template and
+// with a separable one, the outer product of two random vectors (rows marked
+// "s"). The first column is the original kernel, which sums into C in global
+// memory; the others are compared with its result. "-" marks a variant that
+// does not apply to the template. The last column is the cost model's choice
+// between direct and FFT convolution.
+void benchmark(cl::Context const& context, cl::CommandQueue& queue, cl::Device const& device,
+               ConvPrograms& programs)
+{
+    cl::Program const& program = programs.get("");
+    int const N = 1024;
+    int const sizes[] = {3, 5, 7, 9, 15, 21, 31, 45, 64};
+    int const iterations = 10;
+    std::default_random_engine generator(42);
+    std::uniform_real_distribution<float> distribution(-10.0, 10.0);
+
+    cl::Kernel global_sum(program, "matrix_conv_global_sum");
+    cl::Kernel naive(program, "matrix_conv");
+    cl::Kernel tiled(program, "matrix_conv_tiled");
+    size_t const global_sum_block = select_block_size(global_sum, device);
+    size_t const naive_block = select_block_size(naive, device);
+    size_t const tiled_block = select_block_size(tiled, device);
+
+    std::vector<float> A = random_matrix(N, generator);
+    cl::Buffer dev_a(context, CL_MEM_READ_ONLY, sizeof(float) * N * N);
+    cl::Buffer dev_c(context, CL_MEM_READ_WRITE, sizeof(float) * N * N);
+    cl::Buffer dev_tmp(context, CL_MEM_READ_WRITE, sizeof(float) * N * N);
+    queue.enqueueWriteBuffer(dev_a, CL_TRUE, 0, sizeof(float) * N * N, A.data());
+
+    struct Template
+    {
+        int M;
+        cl::Buffer b;
+        bool separable;
+        cl::Buffer u;
+        cl::Buffer v;
+        std::unique_ptr<FftConvolution> fft;
+    };
+    struct Variant
+    {
+        char const* name;
+        std::function<bool(Template const&)> applies;
+        std::function<std::vector<cl::Event>(Template&)> launch;
+    };
+    auto always = [](Template const&) { return true; };
+    std::vector<Variant> const variants = {
+        {"global sum", always, [&](Template& t) -> std::vector<cl::Event> {
+            return {conv_naive(queue, global_sum, global_sum_block, dev_a, t.b, dev_c, N, t.M)}; }},
+        {"register", always, [&](Template& t) -> std::vector<cl::Event> {
+            return {conv_naive(queue, naive, naive_block, dev_a, t.b, dev_c, N, t.M)}; }},
+        {"tiled", [&](Template const& t) { return tile_fits(tiled, device, tiled_block, t.M); },
+         [&](Template& t) -> std::vector<cl::Event> {
+            return {conv_tiled(queue, tiled, tiled_block, dev_a, t.b, dev_c, N, t.M)}; }},
+        {"unrolled", [](Template const& t) { return is_unrolled(t.M); }, [&](Template& t) -> std::vector<cl::Event> {
+            cl::Kernel kernel(programs.for_template(t.M), "matrix_conv");
+            return {conv_naive(queue, kernel, select_block_size(kernel, device), dev_a, t.b, dev_c, N, t.M)}; }},
+        {"tiled unr.", [](Template const& t) { return is_unrolled(t.M); }, [&](Template& t) -> std::vector<cl::Event> {
+            cl::Kernel kernel(programs.for_template(t.M), "matrix_conv_tiled");
+            return {conv_tiled(queue, kernel, select_block_size(kernel, device), dev_a, t.b, dev_c, N, t.M)}; }},
+        {"separable", [](Template const& t) { return t.separable; }, [&](Template& t) {
+            cl::Program const& variant = programs.for_template(t.M);
+            cl::Kernel rows(variant, "conv_rows");
+            cl::Kernel columns(variant, "conv_columns");
+            size_t const block_size = std::min(select_block_size(rows, device), select_block_size(columns, device));
+            return conv_separable(queue, rows, columns, block_size, dev_a, t.u, t.v, dev_tmp, dev_c, N, t.M); }},
+        {"fft", always, [&](Template& t) { return t.fft->enqueue(dev_a, t.b, dev_c); }}
+    };
+
+    std::cout << std::setw(6) << "M";
+    for (Variant const& variant: variants) {
+        std::cout << std::setw(12) << variant.name;
+    }
+    std::cout << std::setw(8) << "model" << " (ms per launch, N = " << N << ")" << std::endl;
+
+    for (int M: sizes) {
+        for (bool outer_product: {false, true}) {
+            std::vector<float> B = random_matrix(M, generator);
+            if (outer_product) {
+                std::vector<float> x(M);
+                std::vector<float> y(M);
+                for (int i = 0; i < M; i++) {
+                    x[i] = distribution(generator);
+                    y[i] = distribution(generator);
+                }
+                for (int i = 0; i < M; i++) {
+                    for (int j = 0; j < M; j++) {
+                        B[i * M + j] = x[i] * y[j];
+                    }
+                }
+            }
+
+            Template t;
+            t.M = M;
+            t.b = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * M * M);
+            queue.enqueueWriteBuffer(t.b, CL_TRUE, 0, sizeof(float) * M * M, B.data());
+            std::vector<float> u;
+            std::vector<float> v;
+            t.separable = separate(B, M, u, v);
+            if (t.separable) {
+                t.u = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * M);
+                t.v = cl::Buffer(context, CL_MEM_READ_ONLY, sizeof(float) * M);
+                queue.enqueueWriteBuffer(t.u, CL_TRUE, 0, sizeof(float) * M, u.data());
+                queue.enqueueWriteBuffer(t.v, CL_TRUE, 0, sizeof(float) * M, v.data());
+            }
+            t.fft.reset(new FftConvolution(context, queue, program, N, M));
+
+            std::cout << std::setw(4) << M << (outer_product ? " s" : "  ");
+            std::vector<float> expected(N * N);
+            std::vector<float> C(N * N);
+            bool mismatch = false;
+            for (size_t k = 0; k < variants.size(); k++) {
+                if (!variants[k].applies(t)) {
+                    std::cout << std::setw(12) << "-";
+                    continue;
+                }
+                double ms = 0;
+                for (int i = 0; i < iterations; i++) {
+                    std::vector<cl::Event> events = variants[k].launch(t);
+                    cl::Event::waitForEvents(events);
+                    ms += elapsed_ms(events);
+                }
+                queue.enqueueReadBuffer(dev_c, CL_TRUE, 0, sizeof(float) * N * N, (k == 0 ? expected : C).data());
+                std::cout << std::setw(12) << std::fixed << std::setprecision(3) << ms / iterations;
+                if (k > 0 && !conv_equal(C, expected)) {
+                    mismatch = true;
+                }
+            }
+            std::cout << std::setw(8) << (prefer_fft(N, M) ? "fft" : "direct")
+                      << (mismatch ? " (mismatch)" : "") << std::endl;
+        }
+    }
+}
+
+int main(int argc, char* argv[])
 {
     try {
         std::vector<cl::Device> devices;
@@ -137,23 +507,10 @@ int main()
         std::string cl_string{std::istreambuf_iterator<char>(cl_file),
                               std::istreambuf_iterator<char>()};
 
-        cl::Program::Sources source(1,
-                                    std::make_pair(cl_string.c_str(),
-                                                   cl_string.length() + 1));
-
-        // create programm
-        cl::Program program(context, source);
+        ConvPrograms programs(context, devices, cl_string);
 
-        // compile opencl source
-        try
-        {
-            program.build(devices);
-        }
-        catch (cl::Error const & e)
-        {
-            std::string log_str = program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(device);
-            std::cout << std::endl << e.what() << " : " << e.err() << std::endl;
-            std::cout << log_str;
+        if (argc > 1 && std::string(argv[1]) == "--benchmark") {
+            benchmark(context, queue, device, programs);
             return 0;
         }
 
@@ -181,9 +538,6 @@ int main()
             }
         }
 
-        // set block size
-        size_t const block_size = 16;
-
         // allocate device buffer to hold message
         cl::Buffer dev_a(context, CL_MEM_READ_ONLY, sizeof(float) * N * N);
         cl::Buffer dev_b(context, CL_MEM_READ_ONLY, sizeof(float) * M * M);
@@ -193,15 +547,33 @@ int main()
         queue.enqueueWriteBuffer(dev_a, CL_TRUE, 0, sizeof(float) * N * N, A.data());
         queue.enqueueWriteBuffer(dev_b, CL_TRUE, 0, sizeof(float) * M * M, B.data());
 
-        // load named kernel from opencl source
-        auto matrix_conv = cl::make_kernel< cl::Buffer&
-                                         , cl::Buffer&
-                                         , cl::Buffer&
-                                         , int
-                                         , int >(program, "matrix_conv");
-        size_t const global_size = (N / block_size + ((N % block_size)?1:0)) * block_size;
-        auto enqueue_args = cl::EnqueueArgs(queue, cl::NDRange(global_size, global_size), cl::NDRange(block_size, block_size));
-        matrix_conv(enqueue_args, dev_a, dev_b, dev_c, N, M);
+        // row and column passes for a separable template, otherwise FFT
+        // convolution where the cost model favours it, otherwise the tiled
+        // kernel unless the template's halo overflows local memory, all
+        // unrolled for the common template sizes
+        cl::Program const& program = programs.for_template(M);
+        cl::Kernel tiled(program, "matrix_conv_tiled");
+        size_t const tiled_block = select_block_size(tiled, device);
+        std::vector<float> u;
+        std::vector<float> v;
+        if (separate(B, M, u, v)) {
+            cl::Buffer dev_u(context, CL_MEM_READ_ONLY, sizeof(float) * M);
+            cl::Buffer dev_v(context, CL_MEM_READ_ONLY, sizeof(float) * M);
+            cl::Buffer dev_tmp(context, CL_MEM_READ_WRITE, sizeof(float) * N * N);
+            queue.enqueueWriteBuffer(dev_u, CL_TRUE, 0, sizeof(float) * M, u.data());
+            queue.enqueueWriteBuffer(dev_v, CL_TRUE, 0, sizeof(float) * M, v.data());
+            cl::Kernel rows(program, "conv_rows");
+            cl::Kernel columns(program, "conv_columns");
+            size_t const block_size = std::min(select_block_size(rows, device), select_block_size(columns, device));
+            conv_separable(queue, rows, columns, block_size, dev_a, dev_u, dev_v, dev_tmp, dev_c, N, M);
+        } else if (prefer_fft(N, M)) {
+            FftConvolution(context, queue, program, N, M).enqueue(dev_a, dev_b, dev_c);
+        } else if (tile_fits(tiled, device, tiled_block, M)) {
+            conv_tiled(queue, tiled, tiled_block, dev_a, dev_b, dev_c, N, M);
+        } else {
+            cl::Kernel naive(program, "matrix_conv");
+            conv_naive(queue, naive, select_block_size(naive, device), dev_a, dev_b, dev_c, N, M);
+        }
         queue.enqueueReadBuffer(dev_c, CL_TRUE, 0, sizeof(float) * N * N, C.data());
 
         // CPU conv calculation check
@@ -1,4 +1,55 @@
-__kernel void matrix_conv(__global float * A, __global float * B, __global float * C, int N, int M)
+// Template size: the m argument of the kernels, or a build-time constant
+// when the host builds a variant with -DM=<size>, which lets the compiler
+// unroll the tap loops; m is ignored then. The template B lives in
+// __constant memory unless the host builds with -DFILTER_SPACE=__global for
+// templates beyond the device's constant buffer size.
+#ifdef M
+#define UNROLL _Pragma("unroll")
+#else
+#define M m
+#define UNROLL
+#endif
+
+#ifndef FILTER_SPACE
+#define FILTER_SPACE __constant
+#endif
+
+// One work-item per element of C, accumulating in a register and writing C
+// once.
+__kernel void matrix_conv(__global float * A, FILTER_SPACE float * B, __global float * C, int N, int m)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+
+   if (i >= N || j >= N)
+     return;
+
+   int HM = (M - 1) / 2;
+
+   float sum = 0;
+   UNROLL
+   for (int k = -HM; k <= HM; k++) {
+     UNROLL
+     for (int l = -HM; l <= HM; l++) {
+       int a_i = i + k;
+       int a_j = j + l;
+
+       if (a_i < 0 || a_j < 0 || a_i >= N || a_j >= N) {
+         continue;
+       }
+
+       int b_i = k + HM;
+       int b_j = l + HM;
+
+       sum += A[a_i * N + a_j] * B[b_i * M + b_j];
+     }
+   }
+   C[i * N + j] = sum;
+}
+
+// The original matrix_conv, which adds every tap into C in global memory.
+// Kept as the baseline of the benchmark.
+__kernel void matrix_conv_global_sum(__global float * A, __global float * B, __global float * C, int N, int m)
 {
    int i = get_global_id(0);
    int j = get_global_id(1);
@@ -25,3 +76,198 @@ __kernel void matrix_conv(__global float * A, __global float * B, __global float
      }
    }
 }
+
+// Same result as matrix_conv. Each square work-group first stages its block
+// of A plus a halo of (M - 1) / 2 on every side in tile, zero outside A, so
+// every element of A is read from global memory once per work-group rather
+// than once per tap. tile holds (get_local_size(0) + 2 * ((M - 1) / 2))^2
+// floats.
+__kernel void matrix_conv_tiled(__global float * A, FILTER_SPACE float * B, __global float * C, int N, int m,
+                                __local float * tile)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+   int li = get_local_id(0);
+   int lj = get_local_id(1);
+   int size = get_local_size(0);
+
+   int HM = (M - 1) / 2;
+   int edge = size + 2 * HM;
+   int top = get_group_id(0) * size - HM;
+   int left = get_group_id(1) * size - HM;
+
+   // work-items are numbered along dimension 0 first, so consecutive ones
+   // load consecutive elements of a row
+   for (int t = lj * size + li; t < edge * edge; t += size * size) {
+     int a_i = top + t / edge;
+     int a_j = left + t % edge;
+     tile[t] = (a_i < 0 || a_j < 0 || a_i >= N || a_j >= N) ? 0 : A[a_i * N + a_j];
+   }
+   barrier(CLK_LOCAL_MEM_FENCE);
+
+   if (i >= N || j >= N)
+     return;
+
+   float sum = 0;
+   UNROLL
+   for (int b_i = 0; b_i <= 2 * HM; b_i++) {
+     UNROLL
+     for (int b_j = 0; b_j <= 2 * HM; b_j++) {
+       sum += tile[(li + b_i) * edge + lj + b_j] * B[b_i * M + b_j];
+     }
+   }
+   C[i * N + j] = sum;
+}
+
+// Two passes of a separable template B = u * v^T, 2M taps per element rather
+// than M^2: conv_rows convolves every row of A with v into T, conv_columns
+// every column of T with u into C. Taps outside A are zero, as in
+// matrix_conv, and rows of T outside A are rows of zeros, so the result
+// matches up to rounding.
+__kernel void conv_rows(__global float * A, FILTER_SPACE float * v, __global float * T, int N, int m)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+
+   if (i >= N || j >= N)
+     return;
+
+   int HM = (M - 1) / 2;
+
+   float sum = 0;
+   UNROLL
+   for (int l = -HM; l <= HM; l++) {
+     int a_j = j + l;
+     if (a_j >= 0 && a_j < N) {
+       sum += A[i * N + a_j] * v[l + HM];
+     }
+   }
+   T[i * N + j] = sum;
+}
+
+__kernel void conv_columns(__global float * T, FILTER_SPACE float * u, __global float * C, int N, int m)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+
+   if (i >= N || j >= N)
+     return;
+
+   int HM = (M - 1) / 2;
+
+   float sum = 0;
+   UNROLL
+   for (int k = -HM; k <= HM; k++) {
+     int t_i = i + k;
+     if (t_i >= 0 && t_i < N) {
+       sum += T[t_i * N + j] * u[k + HM];
+     }
+   }
+   C[i * N + j] = sum;
+}
+
+// FFT convolution. Signal and template are zero-padded to P x P, P a power
+// of two of at least N + (M - 1) / 2, so the circular convolution of the
+// padded arrays never wraps a non-zero tap onto the N x N result. The
+// template is stored flipped, with tap (k, l) at (-k mod P, -l mod P), which
+// turns the convolution into matrix_conv's sum of A[i + k][j + l] * B[k][l].
+
+float2 complex_mul(float2 a, float2 b)
+{
+   return (float2)(a.x * b.x - a.y * b.y, a.x * b.y + a.y * b.x);
+}
+
+float2 twiddle(float angle)
+{
+   float c;
+   float s = sincos(angle, &c);
+   return (float2)(c, s);
+}
+
+__kernel void fft_load_signal(__global float * A, __global float2 * X, int N, int P)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+
+   X[i * P + j] = (float2)(i < N && j < N ? A[i * N + j] : 0, 0);
+}
+
+__kernel void fft_load_template(__global float * B, __global float2 * X, int P, int m)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+
+   int HM = (M - 1) / 2;
+   int k = i <= HM ? -i : P - i;
+   int l = j <= HM ? -j : P - j;
+   bool tap = k >= -HM && k <= HM && l >= -HM && l <= HM;
+   X[i * P + j] = (float2)(tap ? B[(k + HM) * M + l + HM] : 0, 0);
+}
+
+// One Stockham stage over get_global_size(1) transforms of length n, element
+// e of transform t at t * distance + e * stride, from x into y. p is the
+// length of the sub-transforms done by the earlier stages; the stage
+// combines radix of them into transforms of length radix * p. sign is -1 for
+// the forward and 1 for the inverse transform, which is not scaled.
+__kernel void fft_radix2(__global float2 * x, __global float2 * y, int n, int p, int stride, int distance, float sign)
+{
+   int i = get_global_id(0);
+   int t = get_global_id(1);
+   x += t * distance;
+   y += t * distance;
+
+   int k = i & (p - 1);
+   float2 u0 = x[i * stride];
+   float2 u1 = complex_mul(x[(i + n / 2) * stride], twiddle(sign * M_PI_F * k / p));
+
+   int j = ((i - k) << 1) + k;
+   y[j * stride] = u0 + u1;
+   y[(j + p) * stride] = u0 - u1;
+}
+
+__kernel void fft_radix4(__global float2 * x, __global float2 * y, int n, int p, int stride, int distance, float sign)
+{
+   int i = get_global_id(0);
+   int t = get_global_id(1);
+   x += t * distance;
+   y += t * distance;
+
+   int q = n / 4;
+   int k = i & (p - 1);
+   float angle = sign * M_PI_F * k / (2 * p);
+   float2 u0 = x[i * stride];
+   float2 u1 = complex_mul(x[(i + q) * stride], twiddle(angle));
+   float2 u2 = complex_mul(x[(i + 2 * q) * stride], twiddle(2 * angle));
+   float2 u3 = complex_mul(x[(i + 3 * q) * stride], twiddle(3 * angle));
+
+   // 4-point DFT; (u1 - u3) times -i forward, i inverse
+   float2 v0 = u0 + u2;
+   float2 v1 = u0 - u2;
+   float2 v2 = u1 + u3;
+   float2 d = u1 - u3;
+   float2 v3 = sign * (float2)(-d.y, d.x);
+
+   int j = ((i - k) << 2) + k;
+   y[j * stride] = v0 + v2;
+   y[(j + p) * stride] = v1 + v3;
+   y[(j + 2 * p) * stride] = v0 - v2;
+   y[(j + 3 * p) * stride] = v1 - v3;
+}
+
+__kernel void fft_multiply(__global float2 * X, __global float2 * Y)
+{
+   int i = get_global_id(0);
+   X[i] = complex_mul(X[i], Y[i]);
+}
+
+// Real parts of the N x N corner, with the 1 / P^2 of the inverse transform.
+__kernel void fft_store(__global float2 * X, __global float * C, int N, int P)
+{
+   int i = get_global_id(0);
+   int j = get_global_id(1);
+
+   if (i >= N || j >= N)
+     return;
+
+   C[i * N + j] = X[i * P + j].x / ((float)P * P);
+}